@@ -0,0 +1,119 @@
+/*
+ * Minimal PIO-mode driver for the PC's primary IDE channel.
+ * The kernel runs with interrupts disabled, so we just poll.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/spinlock.h>
+
+#include <dev/ide.h>
+
+
+static spinlock ide_lock;	// One command at a time on the channel
+
+#define IDE_TIMEOUT	1000000	// Polls before we give up on a disk
+
+
+// Wait for the disk to finish what it's doing and return its status,
+// or return IDE_ERR if it doesn't get there within IDE_TIMEOUT polls.
+static int
+ide_wait(void)
+{
+	int i, s;
+	for (i = 0; i < IDE_TIMEOUT; i++) {
+		s = inb(IO_IDE1+7);
+		if (!(s & IDE_BSY))
+			return s;
+	}
+	return IDE_ERR;
+}
+
+// Select a disk and set up a transfer of nsecs sectors at 'secno'.
+static void
+ide_start(int disk, uint32_t secno, int nsecs, int cmd)
+{
+	assert(nsecs > 0 && nsecs <= 256);
+	assert(secno < (1 << 28));
+	outb(IO_IDE1+6, 0xE0 | (disk << 4) | ((secno >> 24) & 0x0f));
+	outb(IO_IDE1+2, nsecs & 0xff);
+	outb(IO_IDE1+3, secno);
+	outb(IO_IDE1+4, secno >> 8);
+	outb(IO_IDE1+5, secno >> 16);
+	outb(IO_IDE1+7, cmd);
+}
+
+uint32_t
+ide_init(int disk)
+{
+	static bool inited;
+	if (!inited) {
+		spinlock_init(&ide_lock);
+		outb(IO_IDE1CTL, 0x02);		// nIEN: no disk interrupts
+		inited = 1;
+	}
+
+	spinlock_acquire(&ide_lock);
+	outb(IO_IDE1+6, 0xE0 | (disk << 4));
+	int s = inb(IO_IDE1+7);
+	if (s == 0 || s == 0xff) {		// nobody home
+		spinlock_release(&ide_lock);
+		return 0;
+	}
+
+	outb(IO_IDE1+7, IDE_CMD_IDENT);
+	s = ide_wait();
+	if (s == 0 || (s & (IDE_ERR | IDE_DF)) || !(s & IDE_DRQ)) {
+		spinlock_release(&ide_lock);
+		return 0;
+	}
+	uint16_t id[256];
+	insw(IO_IDE1, id, 256);
+	spinlock_release(&ide_lock);
+
+	return id[60] | (uint32_t)id[61] << 16;	// LBA28 sector count
+}
+
+bool
+ide_read(int disk, uint32_t secno, void *dst, int nsecs)
+{
+	spinlock_acquire(&ide_lock);
+	ide_wait();
+	ide_start(disk, secno, nsecs, IDE_CMD_READ);
+	bool ok = 1;
+	for (; nsecs > 0; nsecs--, dst += IDE_SECTSIZE) {
+		int s = ide_wait();
+		if ((s & (IDE_ERR | IDE_DF)) || !(s & IDE_DRQ)) {
+			ok = 0;
+			break;
+		}
+		insl(IO_IDE1, dst, IDE_SECTSIZE/4);
+	}
+	spinlock_release(&ide_lock);
+	return ok;
+}
+
+bool
+ide_write(int disk, uint32_t secno, const void *src, int nsecs)
+{
+	spinlock_acquire(&ide_lock);
+	ide_wait();
+	ide_start(disk, secno, nsecs, IDE_CMD_WRITE);
+	bool ok = 1;
+	for (; nsecs > 0; nsecs--, src += IDE_SECTSIZE) {
+		int s = ide_wait();
+		if ((s & (IDE_ERR | IDE_DF)) || !(s & IDE_DRQ)) {
+			ok = 0;
+			break;
+		}
+		outsl(IO_IDE1, src, IDE_SECTSIZE/4);
+	}
+	if (ok && (ide_wait() & (IDE_ERR | IDE_DF)))
+		ok = 0;
+	spinlock_release(&ide_lock);
+	return ok;
+}
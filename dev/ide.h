@@ -0,0 +1,49 @@
+/*
+ * Minimal PIO-mode driver for the PC's primary IDE channel,
+ * used for the swap disk (kern/swap.c).
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_IDE_H
+#define PIOS_DEV_IDE_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+#define IDE_SECTSIZE	512
+
+#define IDE_SWAPDISK	1	// Swap is on the primary slave (qemu -hdb);
+				// the boot image is on the master.
+
+#define IO_IDE1		0x1F0	// Primary channel command block
+#define IO_IDE1CTL	0x3F6	// Primary channel device control
+
+#define IDE_BSY		0x80	// Status register bits
+#define IDE_DRDY	0x40
+#define IDE_DF		0x20
+#define IDE_DRQ		0x08
+#define IDE_ERR		0x01
+
+#define IDE_CMD_READ	0x20	// Read sectors, LBA28
+#define IDE_CMD_WRITE	0x30	// Write sectors, LBA28
+#define IDE_CMD_FLUSH	0xE7	// Flush write cache
+#define IDE_CMD_IDENT	0xEC	// Identify device
+
+
+// Probe disk 'disk' (0 = master, 1 = slave) on the primary channel,
+// and return its size in sectors, or 0 if there is no such disk.
+uint32_t ide_init(int disk);
+
+// Read or write 'nsecs' sectors starting at 'secno' on disk 'disk'.
+// Polls for completion, with interrupts from the disk left disabled.
+// Return false on a disk error.
+bool ide_read(int disk, uint32_t secno, void *dst, int nsecs);
+bool ide_write(int disk, uint32_t secno, const void *src, int nsecs);
+
+
+#endif	// !PIOS_DEV_IDE_H
@@ -143,3 +143,15 @@ lapic_startcpu(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send a fixed-delivery interrupt to one other processor.
+void
+lapic_ipi(uint8_t apicid, int vector)
+{
+	if (!lapic)
+		return;
+	while (lapic[ICRLO] & DELIVS)	// previous IPI still on its way
+		;
+	lapicw(ICRHI, apicid<<24);
+	lapicw(ICRLO, vector);
+}
+
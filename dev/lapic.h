@@ -71,5 +71,8 @@ void lapic_errintr(void);
 // Send a message to start an Application Processor (AP) running at addr.
 void lapic_startcpu(uint8_t apicid, uint32_t addr);
 
+// Send interrupt 'vector' to the CPU whose local APIC ID is 'apicid'.
+void lapic_ipi(uint8_t apicid, int vector);
+
 
 #endif /* !PIOS_DEV_LAPIC_H */
@@ -0,0 +1,36 @@
+/*
+ * 8253/8254 Programmable Interval Timer (PIT),
+ * used only as a known time base for calibrating the TSC.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+
+#include <dev/pit.h>
+
+
+uint64_t
+pit_tscfreq(void)
+{
+	static uint64_t freq;
+	if (freq != 0)
+		return freq;
+
+	// Count down PIT_CALMS milliseconds on counter 2,
+	// which isn't wired to an interrupt, and see how far the TSC got.
+	uint16_t count = PIT_HZ * PIT_CALMS / 1000;
+	outb(IO_PITGATE, (inb(IO_PITGATE) & ~0x02) | 0x01);
+	outb(IO_PITCTL, 0xb0);		// counter 2, lo/hi byte, mode 0
+	outb(IO_PIT+2, count & 0xff);
+	outb(IO_PIT+2, count >> 8);
+
+	uint64_t start = rdtsc();
+	while (!(inb(IO_PITGATE) & 0x20))
+		;
+	uint64_t ticks = rdtsc() - start;
+
+	freq = ticks * 1000 / PIT_CALMS;
+	return freq;
+}
@@ -0,0 +1,30 @@
+/*
+ * 8253/8254 Programmable Interval Timer (PIT),
+ * used only as a known time base for calibrating the TSC.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_PIT_H
+#define PIOS_DEV_PIT_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+#define IO_PIT		0x40	// Counter 0 data port; counter 2 is IO_PIT+2
+#define IO_PITCTL	0x43	// Mode control port
+#define IO_PITGATE	0x61	// Counter 2 gate (bit 0) and output (bit 5)
+
+#define PIT_HZ		1193182	// Input clock frequency of every counter
+#define PIT_CALMS	10	// Milliseconds to time the TSC over
+
+
+// Return the TSC's frequency in Hz, measured against the PIT
+// the first time we're called.
+uint64_t pit_tscfreq(void);
+
+#endif	// !PIOS_DEV_PIT_H
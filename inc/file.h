@@ -131,6 +131,7 @@ typedef struct filestate {
 	int		cwd;		// Ref to inode for current directory
 	bool		exited;		// Set to true when this process exits
 	int		status;		// Process exit status - set on exit()
+	bool		nondet;		// Started with PFF_NONDET (see fork.c)
 	filedesc	fd[OPEN_MAX];	// File descriptor table
 	fileinode	fi[FILE_INODES]; // "Inodes" describing actual files
 	procinfo	child[PROC_CHILDREN]; 	// Unix state of child processes
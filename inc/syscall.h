@@ -31,6 +31,11 @@
 #define SYS_COPY	0x00020000	// Get/put virtual copy
 #define SYS_MERGE	0x00030000	// Get: diffs only from last snapshot
 #define SYS_SNAP	0x00040000	// Put: snapshot child state
+#define SYS_UNSNAP	0x00080000	// Get/put: discard child's snapshot
+#define SYS_MSTATS	0x00100000	// Get: merge statistics (with SYS_MERGE)
+#define SYS_RANGE	0x00200000	// Get/put: a range of children at once
+#define SYS_ANY		0x00400000	// Get: any one child of a range
+#define SYS_SNAPONLY	0x00800000	// Put: snapshot only the SYS_COPY region
 
 #define SYS_PERM	0x00000100	// Set memory permissions on get/put
 #define SYS_READ	0x00000200	// Read permission (NB: in PTE_AVAIL)
@@ -47,11 +52,30 @@
 // Register conventions on GET/PUT system call entry:
 //	EAX:	System call command/flags (SYS_*)
 //	EDX:	bits 7-0: Child process number to get/put
+//		bits 31-16: With SYS_RANGE, number of children from there
 //	EBX:	Get/put CPU state pointer for SYS_REGS and/or SYS_FPU)
+//		With SYS_RANGE, PUT starts every child from the same state,
+//		except that each gets its own child number in EDX,
+//		and GET fills in an array of procstates, one per child.
 //	ECX:	Get/put memory region size
 //	ESI:	Get/put local memory region start
 //	EDI:	Get/put child memory region start
-//	EBP:	reserved
+//	EBP:	Get with SYS_MSTATS: mergestats pointer, otherwise reserved
+//		(with SYS_RANGE, the children's statistics added up)
+//
+// A PUT or GET with SYS_RANGE waits for all the children to stop,
+// then does the same memory operations on each child in turn.
+//
+// A GET with SYS_RANGE | SYS_ANY instead picks the first child in the range
+// that has stopped since the last GET or PUT on it, waiting for one
+// if need be, and gets from that child alone.  It returns the child's
+// number in EDX, or -1 if no child in the range is running to wait for.
+// Since the result depends on timing, it needs PFF_NONDET,
+// which no process has unless its parent starts it with that flag.
+//
+// A PUT with SYS_COPY | SYS_SNAP snapshots the child's whole address space;
+// adding SYS_SNAPONLY snapshots just the region copied in, which is cheaper,
+// but then a GET with SYS_MERGE may only merge from within that region.
 
 
 #ifndef __ASSEMBLER__
@@ -63,6 +87,17 @@ typedef struct procstate {
 	fxsave		fx;		// x87/MMX/XMM registers
 } procstate;
 
+// Merge statistics returned by GET with SYS_MERGE | SYS_MSTATS.
+#define MSTATS_CONFLICTS	16	// Conflicting pages listed
+typedef struct mergestats {
+	uint32_t	scanned;	// Pages compared mapping by mapping
+	uint32_t	copied;		// Pages taken whole from the child
+	uint32_t	diffed;		// Bytes compared in pages both changed
+	uint32_t	nconflict;	// Pages dropped on conflicting writes
+	uint32_t	conflicts[MSTATS_CONFLICTS];	// The first of those,
+							// by local address
+} mergestats;
+
 // process feature enable/status flags
 #define PFF_USEFPU	0x0001		// process has used the FPU
 #define PFF_NONDET	0x0100		// enable nondeterministic features
@@ -121,6 +156,75 @@ sys_get(uint32_t flags, uint16_t child, procstate *save,
 		: "cc", "memory");
 }
 
+// PUT or GET on 'n' children starting at 'child', with SYS_RANGE.
+static void gcc_inline
+sys_putrange(uint32_t flags, uint8_t child, uint16_t n, procstate *save,
+		void *localsrc, void *childdest, size_t size)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_PUT | SYS_RANGE | flags),
+		  "b" (save),
+		  "d" (child | (uint32_t)n << 16),
+		  "S" (localsrc),
+		  "D" (childdest),
+		  "c" (size)
+		: "cc", "memory");
+}
+
+static void gcc_inline
+sys_getrange(uint32_t flags, uint8_t child, uint16_t n, procstate *save,
+		void *childsrc, void *localdest, size_t size)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_GET | SYS_RANGE | flags),
+		  "b" (save),
+		  "d" (child | (uint32_t)n << 16),
+		  "S" (childsrc),
+		  "D" (localdest),
+		  "c" (size)
+		: "cc", "memory");
+}
+
+// Wait-any GET: returns the child got from, or -1 if none was running.
+static int gcc_inline
+sys_getany(uint32_t flags, uint8_t child, uint16_t n, procstate *save,
+		void *childsrc, void *localdest, size_t size)
+{
+	int got;
+	asm volatile("int %1" :
+		  "=d" (got)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_GET | SYS_RANGE | SYS_ANY | flags),
+		  "b" (save),
+		  "0" (child | (uint32_t)n << 16),
+		  "S" (childsrc),
+		  "D" (localdest),
+		  "c" (size)
+		: "cc", "memory");
+	return got;
+}
+
+// GET with merge statistics, which need a seventh register: EBP.
+// The compiler may be using EBP, so we save it on the stack
+// and swap the mergestats pointer in for the duration of the INT.
+static void gcc_inline
+sys_getstats(uint32_t flags, uint16_t child, procstate *save,
+		void *childsrc, void *localdest, size_t size, mergestats *ms)
+{
+	asm volatile("pushl %7; xchgl %%ebp,(%%esp); int %0; popl %%ebp" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_GET | SYS_MSTATS | flags),
+		  "b" (save),
+		  "d" (child),
+		  "S" (childsrc),
+		  "D" (localdest),
+		  "c" (size),
+		  "g" (ms)
+		: "cc", "memory");
+}
+
 static void gcc_inline
 sys_ret(void)
 {
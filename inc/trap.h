@@ -47,9 +47,11 @@
 // We use these vectors to receive local per-CPU interrupts
 #define T_LTIMER	49	// Local APIC timer interrupt
 #define T_LERROR	50	// Local APIC error interrupt
+#define T_LIPI		51	// Inter-processor interrupt: wake from HLT
 
 #define T_DEFAULT	500	// Unused trap vectors produce this value
 #define T_ICNT		501	// Child process instruction count expired
+#define T_NOMEM		502	// Out of memory, even after reclaiming
 
 // ISA hardware IRQ numbers. We receive these as (T_IRQ0 + IRQ_WHATEVER)
 #define IRQ_TIMER	0	// 8253 Programmable Interval Timer (PIT)
@@ -39,6 +39,7 @@
 
 // Process management functions
 pid_t	fork(void);
+pid_t	ndfork(void);					// PIOS: see lib/fork.c
 pid_t	wait(int *status);				// trad. in sys/wait.h
 pid_t	waitpid(pid_t pid, int *status, int options);	// trad. in sys/wait.h
 int	execl(const char *path, const char *arg0, ...);
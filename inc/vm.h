@@ -18,7 +18,9 @@
 //   representing the address space in which the kernel operates.
 //   This way the kernel's address space effectively remains the same
 //   both before and after it initializes the MMU and enables paging.
-//   (It also means we can use at most 1GB of physical memory!)
+//   The top 4MB of it is instead a window for temporary kernel mappings,
+//   through which the kernel reaches physical memory above 1GB ("highmem"),
+//   which is used only for pages mapped into user address spaces.
 //
 // - The next 2.75GB contains the running process's user-level address space.
 //   This is the only address range user-mode processes can access or map.
@@ -44,6 +46,8 @@
 //                     |        (see inc/vm.h)        | RW/RW
 //                     |                              | RW/RW
 //    VM_USERLO -----> +==============================+ 0x40000000
+//                     |  Kernel temporary mappings   | RW/--
+//                     +------------------------------+ 0x3fc00000
 //                     |                              | RW/--
 //                     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
 //                     :              .               :
@@ -355,6 +355,15 @@ cli(void)
 	asm volatile("cli");
 }
 
+// Enable interrupts and halt until the next one arrives.
+// STI takes effect only after the following instruction,
+// so no interrupt can slip in between the two and be missed.
+static gcc_inline void
+sti_hlt(void)
+{
+	asm volatile("sti; hlt");
+}
+
 
 
 #endif /* !PIOS_INC_X86_H */
@@ -151,3 +151,13 @@ cpu_bootothers(void)
 	}
 }
 
+void
+cpu_wake(int n)
+{
+	cpu *c;
+	for (c = &cpu_boot; c != NULL && n > 0; c = c->next)
+		if (c != cpu_cur() && c->halted && xchg(&c->halted, 0)) {
+			lapic_ipi(c->id, T_LIPI);
+			n--;
+		}
+}
@@ -32,6 +32,10 @@
 #include <inc/mmu.h>
 #include <inc/trap.h>
 
+#include <kern/mem.h>
+#include <kern/slab.h>
+#include <kern/pmap.h>
+
 
 // Per-CPU kernel state structure.
 // Exactly one page (4096 bytes) in size.
@@ -64,6 +68,65 @@ typedef struct cpu {
 	// Process currently running on this CPU.
 	struct proc	*proc;
 
+	// Processes made ready on this CPU, in FIFO order (kern/proc.c).
+	// Idle CPUs steal from the head of other CPUs' queues.
+	spinlock	readylock;	// Protects the fields below
+	struct proc	*readyhead;	// Next process to run
+	struct proc	**readytail;	// Where to append a ready process
+	uint32_t	nready;		// Processes now on the queue
+	uint32_t	steals;		// Processes this CPU took from others
+	uint32_t	handoffs;	// Waited-on children run by proc_wait()
+
+	// Magazine of free physical pages private to this CPU (kern/mem.c),
+	// refilled from and drained to the global free list in batches.
+	pageinfo	*mag[MEM_MAGSIZE];
+	int		magcount;	// Number of pages now in mag[]
+	uint32_t	maghits;	// mem_alloc()s served from mag[]
+	uint32_t	magmisses;	// mem_alloc()s that refilled mag[]
+	uint32_t	magfrees;	// mem_free()s absorbed by mag[]
+	uint32_t	magdrains;	// mem_free()s that drained mag[]
+
+	// Pre-zeroed page pool usage, see mem_alloc_zero().
+	uint32_t	zerohits;	// Blank pages taken from the pool
+	uint32_t	zeromisses;	// Blank pages cleared on demand
+
+	// Memory reclaim activity, see mem_reclaim().
+	bool		reclaiming;	// Running reclaimers right now
+	uint32_t	reclaims;	// Calls to mem_reclaim()
+	uint32_t	reclaimed;	// Pages those calls freed
+	uint32_t	ooms;		// mem_alloc()s that failed anyway
+
+	// Swap activity, see kern/swap.c.
+	uint32_t	swapouts;	// Pages written out to swap
+	uint32_t	swapins;	// Pages read back from swap
+
+	// TLB invalidations deferred by pmap_invalbegin(), see kern/pmap.c.
+	bool		invbatch;	// Deferring pmap_inval()s right now
+	bool		invall;		// Too many pages: reload CR3 instead
+	int		ninval;		// Pages in invva[]
+	uint32_t	invva[PMAP_INVALMAX];	// Pages left to invlpg
+	uint32_t	tlbflushes;	// CR3 reloads to invalidate ranges
+	uint32_t	tlbinvlpgs;	// Pages invalidated with invlpg
+
+	// 4MB superpages for user memory, see pmap_promote().
+	uint32_t	superpages;	// Page tables turned into superpages
+	uint32_t	supersplits;	// Superpages split back up
+
+	// Time spent halted in proc_sched() with nothing to do,
+	// and how often cpu_wake() interrupted that to hand us work.
+	volatile uint32_t halted;	// Halted or about to halt right now
+	uint64_t	idlecycles;	// TSC cycles spent halted
+	uint32_t	wakeups;	// Wakeup IPIs received
+
+	// Pieces of other CPUs' merges done while idle, see pmap_merge().
+	uint32_t	mergepieces;
+
+	// Unmapped page tables freed while idle, see pmap_remove().
+	uint32_t	teardowns;
+
+	// Free objects of each slab cache kept for this CPU.
+	slab_cpucache	slab[SLAB_MAXCACHES];
+
 	// Magic verification tag (CPU_MAGIC) to help detect corruption,
 	// e.g., if the CPU's ring 0 stack overflows down onto the cpu struct.
 	uint32_t	magic;
@@ -112,6 +175,9 @@ cpu *cpu_alloc(void);
 // Get any additional processors booted up and running.
 void cpu_bootothers(void);
 
+// Wake up to n other CPUs halted in proc_sched(), to look for new work.
+void cpu_wake(int n);
+
 #endif	// ! __ASSEMBLER__
 
 #endif // PIOS_KERN_CPU_H
@@ -0,0 +1,275 @@
+/*
+ * Same-page merging: share identical user pages copy-on-write.
+ *
+ * Idle CPUs walk the page tables of processes that are not running,
+ * hash each page that has not been written since the last visit,
+ * and look the hash up in a table of "stable" pages.
+ * A page identical to a stable one is remapped read-only onto it,
+ * using the same refcounts and write faults as any other COW sharing;
+ * a page of all zeros is simply remapped onto the zero page.
+ * Otherwise the page itself becomes the stable copy for its hash:
+ * the table holds a reference to it, so it is never changed in place.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/vm.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/pmap.h>
+#include <kern/proc.h>
+#include <kern/dedup.h>
+
+
+typedef struct dedup_entry {
+	uint32_t	hash;		// Hash of the page's contents
+	pageinfo	*pi;		// Stable copy, or NULL if slot unused
+} dedup_entry;
+
+// The stable table.  Its lock is always taken last,
+// since mem_reclaim() may get here with a process lock held.
+static spinlock dedup_tablelock;
+static dedup_entry dedup_stable[DEDUP_NSTABLE];
+
+// Where the scan has got to.  Only one idle CPU scans at a time.
+static spinlock dedup_lock;
+static proc *dedup_proc;	// Process being scanned
+static uint32_t dedup_va;	// Next user address to look at in it
+
+static uint32_t dedup_zerohash;	// Hash of an all-zero page
+
+// Statistics, protected by dedup_tablelock.
+static uint32_t dedup_hashed;	// Pages hashed
+static uint32_t dedup_merged;	// Mappings moved onto a stable copy
+static uint32_t dedup_zeroed;	// Mappings moved onto the zero page
+static uint32_t dedup_saved;	// Pages freed by the above
+
+
+static uint32_t
+dedup_hash(const void *pg)
+{
+	const uint32_t *w = pg;
+	uint32_t h = 2166136261u;	// FNV-1a over words
+	int i;
+	for (i = 0; i < PAGESIZE/4; i++)
+		h = (h ^ w[i]) * 16777619u;
+	return h;
+}
+
+// Drop a mapping's reference to page 'pi', counting it if that frees it.
+static void
+dedup_unmap(pageinfo *pi)
+{
+	if (pi->refcount == 1)
+		dedup_saved++;
+	mem_decref(pi, mem_free);
+}
+
+//
+// Look at the user page mapped by 'pte', in a page table private to
+// a process that can't run until we're done with it.
+// No TLB flush is needed, since proc_run() reloads CR3 anyway.
+// Returns true if it hashed the page.
+//
+static bool
+dedup_page(pte_t *pte)
+{
+	uint32_t pa = PGADDR(*pte);
+	if (!(*pte & PTE_P) || pa == PTE_ZERO)
+		return 0;
+	if (*pte & PTE_D) {		// written lately: look again next time
+		*pte &= ~PTE_D;
+		return 0;
+	}
+
+	// A page mapped elsewhere too, such as in a child's snapshot,
+	// frees nothing when remapped, and remapping it would only make
+	// merges against that snapshot diff it instead of copying.
+	pageinfo *pi = mem_phys2pi(pa);
+	if (pi->refcount > 1)
+		return 0;
+	uint8_t *pg = pmap_kmap(pa, PMAP_KMAP_SRC);
+	uint32_t h = dedup_hash(pg);
+	uint32_t perm = PGOFF(*pte) & ~PTE_W;	// keep nominal permissions
+
+	spinlock_acquire(&dedup_tablelock);
+	dedup_hashed++;
+
+	if (h == dedup_zerohash && memcmp(pg, pmap_zero, PAGESIZE) == 0) {
+		*pte = PTE_ZERO | perm;
+		dedup_zeroed++;
+		dedup_unmap(pi);
+		spinlock_release(&dedup_tablelock);
+		return 1;
+	}
+
+	dedup_entry *e = &dedup_stable[h % DEDUP_NSTABLE];
+	if (e->pi != NULL && e->pi != pi && e->hash == h
+			&& memcmp(pg, pmap_kmap(mem_pi2phys(e->pi),
+					PMAP_KMAP_REF), PAGESIZE) == 0) {
+		mem_incref(e->pi);
+		*pte = mem_pi2phys(e->pi) | perm;
+		dedup_merged++;
+		dedup_unmap(pi);
+	} else if (e->pi == NULL || e->pi->refcount == 1) {
+		// Make this page the stable copy, replacing an unused one.
+		if (e->pi != NULL)
+			mem_decref(e->pi, mem_free);
+		mem_incref(pi);
+		*pte = pa | perm;
+		e->hash = h;
+		e->pi = pi;
+	}
+
+	spinlock_release(&dedup_tablelock);
+	return 1;
+}
+
+//
+// Memory reclaimer: free stable copies that nobody maps any more.
+//
+static void
+dedup_reclaim(size_t target)
+{
+	spinlock_acquire(&dedup_tablelock);
+	int i;
+	for (i = 0; i < DEDUP_NSTABLE && mem_nfree < target; i++) {
+		dedup_entry *e = &dedup_stable[i];
+		if (e->pi != NULL && e->pi->refcount == 1) {
+			mem_decref(e->pi, mem_free);
+			e->pi = NULL;
+		}
+	}
+	spinlock_release(&dedup_tablelock);
+}
+
+void
+dedup_init(void)
+{
+	if (!cpu_onboot())
+		return;
+
+	spinlock_init(&dedup_tablelock);
+	spinlock_init(&dedup_lock);
+	dedup_zerohash = dedup_hash(pmap_zero);
+	mem_reclaim_register(dedup_reclaim);
+}
+
+bool
+dedup_idle(void)
+{
+	spinlock_acquire(&dedup_lock);
+
+	bool hashed = 0;
+	int n;
+	for (n = 0; n < DEDUP_BATCH && !hashed; n++) {
+		if (dedup_proc == NULL) {	// start a new pass
+			dedup_proc = proc_all;
+			dedup_va = VM_USERLO;
+			if (dedup_proc == NULL)
+				break;
+		}
+		proc *p = dedup_proc;
+		if (dedup_va >= VM_USERHI) {
+			dedup_proc = p->allnext;
+			dedup_va = VM_USERLO;
+			if (dedup_proc == NULL)
+				break;	// pass done: let the CPU halt a while
+			continue;
+		}
+
+		// A ready or waiting process's memory is left alone
+		// until its lock lets it run again.  Shared page tables
+		// might be in use by a stopped process's parent, so skip them,
+		// and superpages, which aren't worth splitting for this.
+		spinlock_acquire(&p->lock);
+		if (p->state != PROC_READY && p->state != PROC_WAIT)
+			dedup_va = VM_USERHI;	// catch it next pass
+		else {
+			pde_t *pde = &p->pdir[PDX(dedup_va)];
+			if (!(*pde & PTE_P) || (*pde & PTE_PS)
+				|| mem_phys2pi(PGADDR(*pde))->refcount != 1)
+				dedup_va = PTADDR(dedup_va + PTSIZE);
+			else {
+				pte_t *ptab = mem_ptr(PGADDR(*pde));
+				hashed = dedup_page(&ptab[PTX(dedup_va)]);
+				dedup_va += PAGESIZE;
+			}
+		}
+		spinlock_release(&p->lock);
+	}
+
+	spinlock_release(&dedup_lock);
+	return hashed;
+}
+
+void
+dedup_stats(void)
+{
+	spinlock_acquire(&dedup_tablelock);
+	int i, nstable = 0;
+	for (i = 0; i < DEDUP_NSTABLE; i++)
+		if (dedup_stable[i].pi != NULL)
+			nstable++;
+	cprintf("dedup: %d pages hashed, %d merged, %d zeroed, "
+		"%d pages saved; %d stable copies\n",
+		dedup_hashed, dedup_merged, dedup_zeroed,
+		dedup_saved, nstable);
+	spinlock_release(&dedup_tablelock);
+}
+
+void
+dedup_check(void)
+{
+	pageinfo *pi[3];
+	int i;
+
+	// Two identical pages and a blank one, written just now.
+	for (i = 0; i < 3; i++) {
+		pi[i] = mem_alloc(); assert(pi[i] != NULL);
+		memset(mem_pi2ptr(pi[i]), i < 2 ? 0x5a : 0, PAGESIZE);
+		assert(pmap_insert(pmap_bootpdir, pi[i], VM_USERLO + i*PAGESIZE,
+				SYS_RW | PTE_U | PTE_W | PTE_D));
+	}
+	pte_t *pte = pmap_walk(pmap_bootpdir, VM_USERLO, 0);
+	assert(pte != NULL);
+
+	// Dirty pages are only marked clean on the first visit.
+	for (i = 0; i < 3; i++) {
+		assert(!dedup_page(&pte[i]));
+		assert(!(pte[i] & PTE_D) && (pte[i] & PTE_W));
+	}
+
+	// On the next, the first page becomes a stable copy...
+	assert(dedup_page(&pte[0]));
+	assert(pi[0]->refcount == 2 && !(pte[0] & PTE_W));
+
+	// ...the identical page is remapped onto it...
+	assert(dedup_page(&pte[1]));
+	assert(PGADDR(pte[1]) == mem_pi2phys(pi[0]));
+	assert((pte[1] & (SYS_RW | PTE_P | PTE_W)) == (SYS_RW | PTE_P));
+	assert(pi[0]->refcount == 3 && pi[1]->refcount == 0);
+
+	// ...and the blank page onto the zero page.
+	assert(dedup_page(&pte[2]));
+	assert(PGADDR(pte[2]) == PTE_ZERO);
+	assert((pte[2] & (SYS_RW | PTE_P | PTE_W)) == (SYS_RW | PTE_P));
+	assert(pi[2]->refcount == 0);
+	assert(dedup_merged == 1 && dedup_zeroed == 1 && dedup_saved == 2);
+
+	// Once nothing maps the stable copy, reclaiming frees it.
+	pmap_remove(pmap_bootpdir, VM_USERLO, PTSIZE);
+	assert(pi[0]->refcount == 1);
+	dedup_reclaim(~0);
+	assert(pi[0]->refcount == 0);
+	for (i = 0; i < DEDUP_NSTABLE; i++)
+		assert(dedup_stable[i].pi == NULL);
+
+	dedup_hashed = dedup_merged = dedup_zeroed = dedup_saved = 0;
+	cprintf("dedup_check() succeeded!\n");
+}
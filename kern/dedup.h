@@ -0,0 +1,36 @@
+/*
+ * Same-page merging: share identical user pages copy-on-write.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_DEDUP_H
+#define PIOS_KERN_DEDUP_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+#define DEDUP_NSTABLE	1024	// Hash slots for shared page copies
+#define DEDUP_BATCH	64	// Max PTEs dedup_idle() looks at per call
+
+
+// Set up the scanner and register its memory reclaimer.
+void dedup_init(void);
+
+// Called from the idle loop: scan a little further through
+// the user pages of processes that are not running,
+// hashing at most one page.  Returns false if there was nothing to do,
+// including at the end of each pass, so an idle CPU rests in between.
+bool dedup_idle(void);
+
+// Print how many pages the scanner has merged and saved.
+void dedup_stats(void);
+
+// Check same-page merging for correct operation.
+void dedup_check(void);
+
+#endif /* !PIOS_KERN_DEDUP_H */
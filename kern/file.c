@@ -21,6 +21,8 @@
 #include <kern/file.h>
 #include <kern/init.h>
 #include <kern/cons.h>
+#include <kern/dedup.h>
+#include <kern/swap.h>
 
 
 // Build a table of files to include in the initial file system.
@@ -156,6 +158,12 @@ file_io(trapframe *tf)
 	// Has the root process exited?
 	if (files->exited) {
 		cprintf("root process exited with status %d\n", files->status);
+		mem_stats();
+		slab_stats();
+		dedup_stats();
+		swap_stats();
+		pmap_stats();
+		proc_stats();
 		done();
 	}
 
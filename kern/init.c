@@ -24,6 +24,8 @@
 #include <kern/spinlock.h>
 #include <kern/mp.h>
 #include <kern/proc.h>
+#include <kern/dedup.h>
+#include <kern/swap.h>
 #include <dev/nvram.h>
 #include <kern/file.h>
 #include <dev/pic.h>
@@ -84,6 +86,24 @@ init(void)
 	// Initialize the paged virtual memory system.
 	pmap_init();
 
+	// Paging is on, so memory above the direct map is now reachable.
+	mem_highmem_init();
+
+	// The allocator checks are done: let CPUs cache free pages locally.
+	mem_magazine_init();
+
+	// Check the slab allocator for small kernel objects.
+	if (cpu_onboot())
+		slab_check();
+
+	// Set up same-page merging for idle CPUs.
+	dedup_init();
+	if (cpu_onboot())
+		dedup_check();
+
+	// Find the swap disk, if any.
+	swap_init();
+
 	// Find and start other processors in a multiprocessor system
 	mp_init();		// Find info about processors in system
 	pic_init();		// setup the legacy PIC (mainly to disable it)
@@ -28,10 +28,72 @@ spinlock page_spinlock;
 
 pageinfo *mem_pageinfo;		// Metadata array indexed by page number
 
-pageinfo *mem_freelist;		// Start of free page list
+static pageinfo *mem_buddy[MEM_ORDERS];	// Free blocks of each order
+size_t mem_nfree;		// Pages on the buddy free lists
+
+static bool mem_magazines;	// Per-CPU page magazines enabled?
+
+static spinlock mem_zerolock;	// Protects the pre-zeroed page pool
+static pageinfo *mem_zerolist;	// Free pages already cleared to zero
+static int mem_nzero;		// Number of pages on mem_zerolist
+
+static spinlock mem_highlock;	// Protects the highmem free list
+static pageinfo *mem_highlist;	// Free pages at or above MEM_HIGH
+static size_t mem_nhigh;	// Total highmem pages
+static size_t mem_nhighfree;	// Number of pages on mem_highlist
+
+size_t mem_lowwater;		// Free page watermarks for mem_reclaim()
+size_t mem_highwater;
+
+static mem_reclaimer mem_reclaimers[MEM_RECLAIMERS];
+static int mem_nreclaimers;
+
+
+struct e820_mem_map mem_map[MEM_MAP_MAX];	// Physical memory map
+int mem_nmap;			// Number of entries in mem_map
 
 
 void mem_check(void);
+static void mem_buddy_free(pageinfo *pi, int order);
+static pageinfo *mem_zero_pop(bool low);
+static void mem_zero_reclaim(size_t target);
+
+// Name an E820 region type for the boot-time memory summary.
+static const char *
+mem_typename(uint32_t type)
+{
+	switch (type) {
+	case E820TYPE_MEMORY:	return "usable";
+	case E820TYPE_RESERVED:	return "reserved";
+	case E820TYPE_ACPI:	return "ACPI";
+	case E820TYPE_NVS:	return "ACPI NVS";
+	case E820TYPE_UNUSABLE:	return "unusable";
+	default:		return "unknown";
+	}
+}
+
+//
+// Is the physical page at 'paddr' usable RAM according to the memory map?
+// It must lie wholly inside a usable region and overlap no other region,
+// since BIOSes may report reserved ranges that overlap usable ones.
+//
+static bool
+mem_usable(uint32_t paddr)
+{
+	uint64_t lo = paddr, hi = (uint64_t)paddr + PAGESIZE;
+	bool usable = 0;
+	int i;
+	for (i = 0; i < mem_nmap; i++) {
+		struct e820_mem_map *m = &mem_map[i];
+		if (hi <= m->base || lo >= m->base + m->size)
+			continue;		// no overlap
+		if (m->type != E820TYPE_MEMORY)
+			return 0;
+		if (lo >= m->base && hi <= m->base + m->size)
+			usable = 1;
+	}
+	return usable;
+}
 
 void
 mem_init(void)
@@ -39,53 +101,68 @@ mem_init(void)
 	if (!cpu_onboot())	// only do once, on the boot CPU
 		return;
 
-	// Determine how much base (<640K) and extended (>1MB) memory
-	// is available in the system (in bytes),
-	// by reading the PC's BIOS-managed nonvolatile RAM (NVRAM).
-	// The NVRAM tells us how many kilobytes there are.
-	// Since the count is 16 bits, this gives us up to 64MB of RAM;
-	// additional RAM beyond that would have to be detected another way.
-	size_t basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024, PAGESIZE);
-	size_t extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024, PAGESIZE);
-
-	warn("Assuming we have 1GB of memory!");
-	extmem = 1024*1024*1024 - MEM_EXT;	// assume 1GB total memory
+	// Ask the BIOS for the physical memory map (E820).
+	// If it has none, fall back on the PC's BIOS-managed nonvolatile RAM,
+	// which tells us how many kilobytes of base (<640K)
+	// and extended (>1MB) memory there are.
+	// Since that count is 16 bits, it only gives us up to 64MB of RAM.
+	mem_nmap = detect_memory_e820(mem_map);
+	if (mem_nmap == 0) {
+		warn("mem_init: no E820 memory map, using NVRAM sizes");
+		size_t basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024,
+						PAGESIZE);
+		size_t extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024,
+						PAGESIZE);
+		mem_map[0].base = 0;
+		mem_map[0].size = basemem;
+		mem_map[0].type = E820TYPE_MEMORY;
+		mem_map[1].base = MEM_EXT;
+		mem_map[1].size = extmem;
+		mem_map[1].type = E820TYPE_MEMORY;
+		mem_nmap = 2;
+	}
 
-	// The maximum physical address is the top of extended memory.
-	mem_max = MEM_EXT + extmem;
+	// The maximum physical address is the top of the highest usable
+	// region, limited to the 4GB we can reach without PAE.
+	// Memory above MEM_HIGH is highmem, for user pages only.
+	uint64_t top = 0, usable = 0;
+	int i;
+	for (i = 0; i < mem_nmap; i++) {
+		struct e820_mem_map *m = &mem_map[i];
+		uint64_t end = m->base + m->size;
+		cprintf("  e820: %08llx-%08llx %s (%dK)\n",
+			m->base, end - 1, mem_typename(m->type),
+			(int)(m->size >> 10));
+		if (m->type != E820TYPE_MEMORY)
+			continue;
+		if (end > top)
+			top = end;
+		usable += m->size;
+	}
+	if (top > MEM_PHYSMAX) {
+		warn("mem_init: ignoring %dMB of memory above 4GB",
+			(int)((top - MEM_PHYSMAX) >> 20));
+		top = MEM_PHYSMAX;
+	}
+	mem_max = ROUNDDOWN((size_t)top, PAGESIZE);
 
 	// Compute the total number of physical pages (including I/O holes)
 	mem_npage = mem_max / PAGESIZE;
 
-	cprintf("Physical memory: %dK available, ", (int)(mem_max/1024));
-	cprintf("base = %dK, extended = %dK\n",
-		(int)(basemem/1024), (int)(extmem/1024));
-
-
-	// Insert code here to:
-	// (1)	allocate physical memory for the mem_pageinfo array,
-	//	making it big enough to hold mem_npage entries.
-	// (2)	add all pageinfo structs in the array representing
-	//	available memory that is not in use for other purposes.
-	//
-	// For step (2), here is some incomplete/incorrect example code
-	// that simply marks all mem_npage pages as free.
-	// Which memory is actually free?
-	//  1) Reserve page 0 for the real-mode IDT and BIOS structures
-	//     (do not allow this page to be used for anything else).
-	//  2) Reserve page 1 for the AP bootstrap code (boot/bootother.S).
-	//  3) Mark the rest of base memory as free.
-	//  4) Then comes the IO hole [MEM_IO, MEM_EXT).
-	//     Mark it as in-use so that it can never be allocated.      
-	//  5) Then extended memory [MEM_EXT, ...).
-	//     Some of it is in use, some is free.
-	//     Which pages hold the kernel and the pageinfo array?
-	//     Hint: the linker places the kernel (see start and end above),
-	//     but YOU decide where to place the pageinfo array.
-	// Change the code to reflect this.
-
-	// ...and remove this when you're ready.
-//panic("mem_init() not implemented");
+	cprintf("Physical memory: %dK available in %d regions, top %dK\n",
+		(int)(usable >> 10), mem_nmap, (int)(mem_max/1024));
+
+
+	// Now (1) allocate physical memory for the mem_pageinfo array,
+	// making it big enough to hold mem_npage entries,
+	// and (2) free every page that lies wholly within usable memory
+	// and isn't in use for other purposes:
+	//  1) Page 0 holds the real-mode IDT and BIOS structures.
+	//  2) Page 1 holds the AP bootstrap code (boot/bootother.S).
+	//  3) The IO hole [MEM_IO, MEM_EXT) is never usable.
+	//  4) The kernel, and the pageinfo array we place right after it.
+	// Reserved, ACPI and NVS ranges stay allocated forever.
+	// Highmem stays allocated until mem_highmem_init() frees it.
   // start at the beginning of memeory
   mem_pageinfo = (pageinfo *) ROUNDUP(((int)end), sizeof(pageinfo));
 
@@ -93,10 +170,10 @@ mem_init(void)
   memset(mem_pageinfo, 0, sizeof(pageinfo) * mem_npage);
 
   spinlock_init(&page_spinlock);
+  spinlock_init(&mem_zerolock);
+  spinlock_init(&mem_highlock);
+  assert((uint32_t) &mem_pageinfo[mem_npage] <= MEM_HIGH);
 
-	pageinfo **freetail = &mem_freelist;
-
-	int i;
 	for (i = 0; i < mem_npage; i++) {
 
     // physical address of current pageinfo
@@ -104,22 +181,227 @@ mem_init(void)
     if ((i == 0 || i == 1 || // pages 0 and 1 are reserved for idt, bios, and bootstrap (see above)
           (paddr + PAGESIZE >= MEM_IO && paddr < MEM_EXT) || // IO section is reserved
           (paddr + PAGESIZE >= (uint32_t) &start[0] && paddr < (uint32_t) &end[0]) || // kernel, 
-          (paddr + PAGESIZE >= (uint32_t) &mem_pageinfo && // start of pageinfo array
-           paddr < (uint32_t) &mem_pageinfo[mem_npage]) // end of pageinfo array
+          (paddr + PAGESIZE >= (uint32_t) mem_pageinfo && // start of pageinfo array
+           paddr < (uint32_t) &mem_pageinfo[mem_npage]) || // end of pageinfo array
+          !mem_usable(paddr) || // not RAM, or reserved by the BIOS
+          paddr >= MEM_HIGH // highmem, freed later
      )) {
       mem_pageinfo[i].refcount = 1; 
     } else {
       mem_pageinfo[i].refcount = 0; 
-      // Add the page to the end of the free list.
-      *freetail = &mem_pageinfo[i];
-      freetail = &mem_pageinfo[i].free_next;
+      // Add the page to the free lists, merging it with its buddies.
+      mem_buddy_free(&mem_pageinfo[i], 0);
     }
 	}
 
-	*freetail = NULL;	// null-terminate the freelist
-
 	// Check to make sure the page allocator seems to work correctly.
 	mem_check();
+
+	// Start reclaiming once less than 1/64th of memory is left free.
+	mem_lowwater = MAX(mem_nfree / 64, 64);
+	mem_highwater = mem_lowwater * 2;
+	mem_reclaim_register(mem_zero_reclaim);
+}
+
+//
+// Make a real-mode BIOS call through the bioscall trampoline
+// in boot/bootother.S, which init() copies to lowmem_bootother_vec.
+// The trampoline finds the registers just below the code at BIOSREGS_LOC.
+// It drops all the way to real mode and back without restoring CR3,
+// so it can only be used before pmap_init() turns on paging.
+//
+void
+bios_call(struct bios_regs *inp)
+{
+	struct bios_regs *regs = mem_ptr(BIOSREGS_LOC - BIOSREGS_SIZE);
+	void (*bioscall)(void) = *(void (**)(void)) lowmem_bioscall_vec;
+
+	*regs = *inp;
+	bioscall();
+	*inp = *regs;
+}
+
+//
+// Read the BIOS memory map with INT 15h, AX=E820h,
+// one entry per call into the low-memory buffer at BIOS_BUFF_ES:DI.
+// Returns the number of entries stored in m, or 0 if E820 is unsupported.
+//
+int
+detect_memory_e820(struct e820_mem_map m[MEM_MAP_MAX])
+{
+	// Each entry is base (8 bytes), size (8), type (4),
+	// and optionally ACPI 3.0 extended attributes (4).
+	uint8_t *buf = mem_ptr(BIOS_BUFF_ES*16 + BIOS_BUFF_DI);
+	struct bios_regs r;
+	uint32_t next = 0;
+	int n = 0;
+
+	do {
+		memset(&r, 0, sizeof(r));
+		r.eax = 0xE820;
+		r.ebx = next;
+		r.ecx = 24;
+		r.edx = SMAP;
+		r.edi = BIOS_BUFF_DI;
+		r.es = BIOS_BUFF_ES;
+		r.int_no = 0x15;
+		*(uint32_t*)(buf + 20) = 1;	// in case it returns 20 bytes
+		bios_call(&r);
+		if (r.cf || r.eax != SMAP)	// unsupported, or past the end
+			break;
+		next = r.ebx;
+
+		// Skip empty entries, and ones the ACPI 3.0 attributes say
+		// to ignore (bit 0 clear).
+		uint64_t size = *(uint64_t*)(buf + 8);
+		if (size == 0 || (r.ecx >= 24 && !(*(uint32_t*)(buf + 20) & 1)))
+			continue;
+		m[n].base = *(uint64_t*)buf;
+		m[n].size = size;
+		m[n].type = *(uint32_t*)(buf + 16);
+		n++;
+	} while (next != 0 && n < MEM_MAP_MAX);
+
+	if (next != 0 && n == MEM_MAP_MAX)
+		warn("detect_memory_e820: more than %d entries", MEM_MAP_MAX);
+	return n;
+}
+
+//
+// Push the free block of 2^order pages starting at pi onto its free list.
+// Like the other mem_buddy functions, called with page_spinlock held.
+//
+static void
+mem_buddy_push(pageinfo *pi, int order)
+{
+	pi->free = 1;
+	pi->order = order;
+	pi->free_next = mem_buddy[order];
+	pi->free_prev = &mem_buddy[order];
+	if (pi->free_next != NULL)
+		pi->free_next->free_prev = &pi->free_next;
+	mem_buddy[order] = pi;
+	mem_nfree += 1 << order;
+}
+
+// Remove a free block from the middle of its free list.
+static void
+mem_buddy_unlink(pageinfo *pi)
+{
+	assert(pi->free);
+	*pi->free_prev = pi->free_next;
+	if (pi->free_next != NULL)
+		pi->free_next->free_prev = pi->free_prev;
+	pi->free_next = NULL;
+	pi->free_prev = NULL;
+	pi->free = 0;
+	mem_nfree -= 1 << pi->order;
+}
+
+//
+// Take a block of 2^order pages from the smallest free list that has one,
+// splitting larger blocks and putting the unused upper halves back.
+//
+static pageinfo *
+mem_buddy_alloc(int order)
+{
+	int k = order;
+	while (k < MEM_ORDERS && mem_buddy[k] == NULL)
+		k++;
+	if (k == MEM_ORDERS)
+		return NULL;
+
+	pageinfo *pi = mem_buddy[k];
+	mem_buddy_unlink(pi);
+	while (k > order) {
+		k--;
+		mem_buddy_push(pi + (1 << k), k);
+	}
+	pi->order = order;
+	return pi;
+}
+
+//
+// Free a block of 2^order pages, merging it with its buddy -
+// the other half of the next larger aligned block - for as long as
+// that buddy is itself a free block of the same size.
+//
+static void
+mem_buddy_free(pageinfo *pi, int order)
+{
+	size_t pn = pi - mem_pageinfo;
+	assert((pn & ((1 << order) - 1)) == 0);
+
+	for (; order < MEM_MAXORDER; order++) {
+		size_t bn = pn ^ (1 << order);
+		if (bn >= mem_npage)
+			break;
+		pageinfo *buddy = &mem_pageinfo[bn];
+		if (!buddy->free || buddy->order != order)
+			break;
+		mem_buddy_unlink(buddy);
+		pn &= ~(1 << order);
+	}
+	mem_buddy_push(&mem_pageinfo[pn], order);
+}
+
+//
+// Move up to 'n' pages from the global free list into CPU c's magazine.
+// Returns the number of pages moved.
+//
+static int
+mem_magfill(cpu *c, int n)
+{
+	int moved = 0;
+	spinlock_acquire(&page_spinlock);
+	while (moved < n) {
+		pageinfo *pi = mem_buddy_alloc(0);
+		if (pi == NULL)
+			break;
+		c->mag[c->magcount++] = pi;
+		moved++;
+	}
+	spinlock_release(&page_spinlock);
+	return moved;
+}
+
+//
+// Return the 'n' least-recently freed pages in CPU c's magazine
+// to the global free list, all under a single acquisition of the lock.
+//
+static void
+mem_magdrain(cpu *c, int n)
+{
+	assert(n <= c->magcount);
+	spinlock_acquire(&page_spinlock);
+	int i;
+	for (i = 0; i < n; i++)
+		mem_buddy_free(c->mag[i], 0);
+	spinlock_release(&page_spinlock);
+
+	// Slide the remaining (most recently freed) pages down.
+	c->magcount -= n;
+	memmove(&c->mag[0], &c->mag[n], c->magcount * sizeof(c->mag[0]));
+}
+
+//
+// Last resort for mem_alloc() once the buddy lists are empty:
+// use a pre-zeroed lowmem page, or reclaim memory and try one more time.
+// mem_alloc() callers reach their pages through mem_pi2ptr(),
+// so highmem pool pages are left for mem_alloc_zero().
+//
+static pageinfo *
+mem_alloc_last(void)
+{
+	pageinfo *pi = mem_zero_pop(1);
+	if (pi == NULL && mem_reclaim(mem_highwater) > 0) {
+		spinlock_acquire(&page_spinlock);
+		pi = mem_buddy_alloc(0);
+		spinlock_release(&page_spinlock);
+	}
+	if (pi == NULL)
+		cpu_cur()->ooms++;
+	return pi;
 }
 
 //
@@ -131,21 +413,35 @@ mem_init(void)
 //   - a pointer to the page's pageinfo struct if successful
 //   - NULL if no available physical pages.
 //
-// Hint: pi->refs should not be incremented 
-// Hint: be sure to use proper mutual exclusion for multiprocessor operation.
+// Once mem_magazine_init() has run, pages come from the current CPU's
+// magazine, which is refilled a batch at a time from the global free list;
+// so only one mem_alloc() in MEM_MAGBATCH needs to take page_spinlock.
+// The kernel runs with interrupts disabled, so the magazine needs no lock.
+// Refills also check the free page count against mem_lowwater,
+// so memory is reclaimed before it actually runs out.
+//
 pageinfo *
 mem_alloc(void)
 {
-	// Fill this function in
-	// Fill this function in.
-//	panic("mem_alloc not implemented.");
+	if (mem_magazines) {
+		cpu *c = cpu_cur();
+		if (c->magcount > 0)
+			c->maghits++;
+		else {
+			c->magmisses++;
+			if (mem_nfree < mem_lowwater)	// racy peek is fine
+				mem_reclaim(mem_highwater);
+			if (mem_magfill(c, MEM_MAGBATCH) == 0)
+				return mem_alloc_last();
+		}
+		return c->mag[--c->magcount];
+	}
+
   spinlock_acquire(&page_spinlock);
-  pageinfo *pi = mem_freelist;
-  if (pi != NULL) {
-    mem_freelist = pi->free_next; // move front of list to next pageinfo
-    pi->free_next = NULL; // remove pointer to next item
-  }
+  pageinfo *pi = mem_buddy_alloc(0);
   spinlock_release(&page_spinlock);
+  if (pi == NULL)
+    pi = mem_alloc_last();
   return pi;
 }
 
@@ -156,20 +452,350 @@ mem_alloc(void)
 void
 mem_free(pageinfo *pi)
 {
-	// Fill this function in.
-	//panic("mem_free not implemented.");
   // do not free in use, or already free pages
   if (pi->refcount != 0)
     panic("mem_free: refcound does not equal zero");
-  if (pi->free_next != NULL)
+  if (pi->free || pi->free_next != NULL)
     panic("mem_free: attempt to free already free page");
 
+	if (mem_pi2phys(pi) >= MEM_HIGH) {	// highmem has its own list
+		spinlock_acquire(&mem_highlock);
+		pi->free_next = mem_highlist;
+		mem_highlist = pi;
+		mem_nhighfree++;
+		spinlock_release(&mem_highlock);
+		return;
+	}
+
+	// While reclaiming, pages go straight back to the buddy lists
+	// so that they show up in mem_nfree.
+	if (mem_magazines && !cpu_cur()->reclaiming) {
+		cpu *c = cpu_cur();
+		if (c->magcount < MEM_MAGSIZE)
+			c->magfrees++;
+		else {
+			c->magdrains++;
+			mem_magdrain(c, MEM_MAGBATCH);
+		}
+		c->mag[c->magcount++] = pi;
+		return;
+	}
+
   spinlock_acquire(&page_spinlock);
-  pi->free_next = mem_freelist; // point this to the list
-  mem_freelist = pi; // point the front of the list to this
+  mem_buddy_free(pi, 0);
   spinlock_release(&page_spinlock);
 }
 
+// Take a page off the highmem free list, or return NULL if it is empty.
+static pageinfo *
+mem_high_pop(void)
+{
+	spinlock_acquire(&mem_highlock);
+	pageinfo *pi = mem_highlist;
+	if (pi != NULL) {
+		mem_highlist = pi->free_next;
+		pi->free_next = NULL;
+		mem_nhighfree--;
+	}
+	spinlock_release(&mem_highlock);
+	return pi;
+}
+
+//
+// Allocate a page for user data.  Highmem goes first,
+// keeping directly mapped memory for the kernel's own page tables
+// and data structures as long as possible.
+//
+pageinfo *
+mem_alloc_high(void)
+{
+	pageinfo *pi = mem_high_pop();
+	return pi != NULL ? pi : mem_alloc();
+}
+
+void
+mem_highmem_init(void)
+{
+	if (!cpu_onboot())
+		return;
+
+	// Free from the top down, so that the list hands pages out
+	// in ascending order: a region filled in order then lies in order
+	// in physical memory too, and may become a superpage in place.
+	uint32_t paddr = ROUNDDOWN(mem_max, PAGESIZE);
+	while (paddr > MEM_HIGH) {
+		paddr -= PAGESIZE;
+		pageinfo *pi = mem_phys2pi(paddr);
+		if (!mem_usable(paddr))
+			continue;
+		mem_nhigh++;
+		pi->refcount = 0;
+		mem_free(pi);
+	}
+	if (mem_nhigh > 0)
+		cprintf("highmem: %d pages above %dMB\n",
+			mem_nhigh, MEM_HIGH >> 20);
+}
+
+// Take a page off the pre-zeroed pool, or return NULL if it is empty.
+// If 'low', only a directly mapped page below MEM_HIGH will do.
+static pageinfo *
+mem_zero_pop(bool low)
+{
+	spinlock_acquire(&mem_zerolock);
+	pageinfo **pp = &mem_zerolist;
+	while (low && *pp != NULL && mem_pi2phys(*pp) >= MEM_HIGH)
+		pp = &(*pp)->free_next;
+	pageinfo *pi = *pp;
+	if (pi != NULL) {
+		*pp = pi->free_next;
+		pi->free_next = NULL;
+		mem_nzero--;
+	}
+	spinlock_release(&mem_zerolock);
+	return pi;
+}
+
+//
+// Allocate a page that reads as all zeros, for fault handlers
+// that would otherwise have to clear it while the process waits.
+// Pages zeroed ahead of time by mem_zero_idle() are used first.
+//
+pageinfo *
+mem_alloc_zero(void)
+{
+	cpu *c = cpu_cur();
+	pageinfo *pi = mem_zero_pop(0);
+	if (pi != NULL) {
+		c->zerohits++;
+		return pi;
+	}
+
+	c->zeromisses++;
+	pi = mem_alloc_high();
+	if (pi != NULL)
+		memset(pmap_kmap(mem_pi2phys(pi), PMAP_KMAP_TMP), 0, PAGESIZE);
+	return pi;
+}
+
+//
+// Called repeatedly by idle CPUs: top up the pre-zeroed pool by one page.
+// Pool pages only ever back user memory, so highmem is used first;
+// otherwise the page comes straight from the buddy lists,
+// so the idle CPU's magazine is left alone for whatever it runs next,
+// and only while memory is plentiful.
+//
+bool
+mem_zero_idle(void)
+{
+	if (mem_nzero >= MEM_ZEROMAX)	// racy peek, rechecked below
+		return 0;
+
+	pageinfo *pi = mem_high_pop();
+	if (pi == NULL) {
+		spinlock_acquire(&page_spinlock);
+		if (mem_nfree > mem_highwater)	// don't undo mem_reclaim()
+			pi = mem_buddy_alloc(0);
+		spinlock_release(&page_spinlock);
+		if (pi == NULL)
+			return 0;
+	}
+
+	memset(pmap_kmap(mem_pi2phys(pi), PMAP_KMAP_TMP), 0, PAGESIZE);
+
+	spinlock_acquire(&mem_zerolock);
+	bool full = mem_nzero >= MEM_ZEROMAX;
+	if (!full) {
+		pi->free_next = mem_zerolist;
+		mem_zerolist = pi;
+		mem_nzero++;
+	}
+	spinlock_release(&mem_zerolock);
+
+	if (full)			// another CPU filled it first
+		mem_free(pi);
+	return !full;
+}
+
+// Reclaimer for the pre-zeroed pool: zeroing the pages again later is cheap.
+// Only lowmem pages help bring mem_nfree up; highmem ones stay pooled.
+static void
+mem_zero_reclaim(size_t target)
+{
+	pageinfo *pi;
+	while (mem_nfree < target && (pi = mem_zero_pop(1)) != NULL)
+		mem_free(pi);
+}
+
+void
+mem_reclaim_register(mem_reclaimer fn)
+{
+	assert(mem_nreclaimers < MEM_RECLAIMERS);
+	mem_reclaimers[mem_nreclaimers++] = fn;
+}
+
+//
+// Free cached memory until 'target' pages are free on the buddy lists.
+// Pages freed while reclaiming bypass this CPU's magazine,
+// and a reclaimer that ends up back in mem_alloc() can't recurse.
+// Returns the number of lowmem pages freed: highmem pages freed along the way
+// can't satisfy mem_alloc(), so they don't count.
+//
+size_t
+mem_reclaim(size_t target)
+{
+	cpu *c = cpu_cur();
+	if (c->reclaiming)
+		return 0;
+	c->reclaiming = 1;
+	c->reclaims++;
+
+	size_t before = mem_nfree;	// racy, just a count
+	int i;
+	for (i = 0; i < mem_nreclaimers && mem_nfree < target; i++)
+		mem_reclaimers[i](target);
+	size_t after = mem_nfree;
+
+	c->reclaiming = 0;
+	size_t freed = after > before ? after - before : 0;
+	c->reclaimed += freed;
+	return freed;
+}
+
+//
+// Allocate 2^order physically contiguous pages, aligned to their size.
+// Single pages should come from mem_alloc(), which avoids page_spinlock.
+//
+pageinfo *
+mem_alloc_order(int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+
+	spinlock_acquire(&page_spinlock);
+	pageinfo *pi = mem_buddy_alloc(order);
+	spinlock_release(&page_spinlock);
+	return pi;
+}
+
+void
+mem_free_order(pageinfo *pi, int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	int i;
+	for (i = 0; i < (1 << order); i++)
+		if (pi[i].refcount != 0 || pi[i].free)
+			panic("mem_free_order: block page %d in use or free", i);
+
+	spinlock_acquire(&page_spinlock);
+	mem_buddy_free(pi, order);
+	spinlock_release(&page_spinlock);
+}
+
+//
+// Hide every free block from the allocator.
+// Clearing their free flags also keeps freed pages from merging with them.
+//
+void
+mem_stash_free(mem_stash *st)
+{
+	spinlock_acquire(&page_spinlock);
+	int k;
+	for (k = 0; k < MEM_ORDERS; k++) {
+		pageinfo *pi;
+		for (pi = mem_buddy[k]; pi != NULL; pi = pi->free_next)
+			pi->free = 0;
+		st->list[k] = mem_buddy[k];
+		mem_buddy[k] = NULL;
+	}
+	mem_nfree = 0;
+	spinlock_release(&page_spinlock);
+}
+
+// Free the stashed blocks again, merging them with anything freed since.
+void
+mem_unstash_free(mem_stash *st)
+{
+	spinlock_acquire(&page_spinlock);
+	int k;
+	for (k = 0; k < MEM_ORDERS; k++) {
+		pageinfo *pi = st->list[k], *next;
+		for (; pi != NULL; pi = next) {
+			next = pi->free_next;
+			pi->free_next = NULL;
+			mem_buddy_free(pi, k);
+		}
+		st->list[k] = NULL;
+	}
+	spinlock_release(&page_spinlock);
+}
+
+void
+mem_magazine_init(void)
+{
+	if (!cpu_onboot())
+		return;
+
+	mem_magazines = 1;
+}
+
+// Percentage of 'part' in 'part + rest', avoiding division by zero.
+static int
+mem_pct(uint32_t part, uint32_t rest)
+{
+	uint32_t total = part + rest;
+	return total ? (int)((uint64_t)part * 100 / total) : 0;
+}
+
+void
+mem_stats(void)
+{
+	// A snapshot of the buddy lists: how many free blocks of each order,
+	// and the share of free memory too fragmented for a 4MB block.
+	int nblocks[MEM_ORDERS];
+	int k;
+	spinlock_acquire(&page_spinlock);
+	for (k = 0; k < MEM_ORDERS; k++) {
+		pageinfo *pi;
+		nblocks[k] = 0;
+		for (pi = mem_buddy[k]; pi != NULL; pi = pi->free_next)
+			nblocks[k]++;
+	}
+	uint32_t nfree = mem_nfree;
+	spinlock_release(&page_spinlock);
+
+	uint32_t nbig = nblocks[MEM_MAXORDER] << MEM_MAXORDER;
+	cprintf("buddy: %d free pages, %d%% unusable for %dKB blocks; by order:",
+		nfree, mem_pct(nfree - nbig, nbig),
+		(PAGESIZE << MEM_MAXORDER) / 1024);
+	for (k = 0; k < MEM_ORDERS; k++)
+		cprintf(" %d", nblocks[k]);
+	cprintf("\n");
+	cprintf("zero pool: %d of %d pages\n", mem_nzero, MEM_ZEROMAX);
+	if (mem_nhigh > 0)
+		cprintf("highmem: %d of %d pages free\n",
+			mem_nhighfree, mem_nhigh);
+
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		cprintf("cpu%d: magazine %d pages, "
+			"alloc %d hits %d misses (%d%%), "
+			"free %d hits %d drains (%d%%)\n",
+			c->id, c->magcount,
+			c->maghits, c->magmisses,
+			mem_pct(c->maghits, c->magmisses),
+			c->magfrees, c->magdrains,
+			mem_pct(c->magfrees, c->magdrains));
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		cprintf("cpu%d: zero pool %d hits %d misses (%d%%)\n",
+			c->id, c->zerohits, c->zeromisses,
+			mem_pct(c->zerohits, c->zeromisses));
+	cprintf("reclaim: watermarks %d/%d pages\n",
+		mem_lowwater, mem_highwater);
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		cprintf("cpu%d: reclaim %d calls %d pages, %d out of memory\n",
+			c->id, c->reclaims, c->reclaimed, c->ooms);
+}
+
 //
 // Check the physical page allocator (mem_alloc(), mem_free())
 // for correct operation after initialization via mem_init().
@@ -178,20 +804,22 @@ void
 mem_check()
 {
 	pageinfo *pp, *pp0, *pp1, *pp2;
-	pageinfo *fl;
-	int i;
+	mem_stash st;
+	int i, k;
 
         // if there's a page that shouldn't be on
         // the free list, try to make sure it
         // eventually causes trouble.
 	int freepages = 0;
-	for (pp = mem_freelist; pp != 0; pp = pp->free_next) {
-		memset(mem_pi2ptr(pp), 0x97, 128);
-		freepages++;
-	}
+	for (k = 0; k < MEM_ORDERS; k++)
+		for (pp = mem_buddy[k]; pp != 0; pp = pp->free_next)
+			for (i = 0; i < (1 << k); i++) {
+				memset(mem_pi2ptr(pp + i), 0x97, 128);
+				freepages++;
+			}
 	cprintf("mem_check: %d free pages\n", freepages);
 	assert(freepages < mem_npage);	// can't have more free than total!
-	assert(freepages > 16000);	// make sure it's in the right ballpark
+	assert(freepages > MIN(mem_npage, MEM_HIGH/PAGESIZE) / 2);	// make sure it's in the right ballpark
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -207,8 +835,7 @@ mem_check()
         assert(mem_pi2phys(pp2) < mem_npage*PAGESIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = mem_freelist;
-	mem_freelist = 0;
+	mem_stash_free(&st);
 
 	// should be no free memory
 	assert(mem_alloc() == 0);
@@ -227,12 +854,90 @@ mem_check()
 	assert(mem_alloc() == 0);
 
 	// give free list back
-	mem_freelist = fl;
+	mem_unstash_free(&st);
 
 	// free the pages we took
 	mem_free(pp0);
 	mem_free(pp1);
 	mem_free(pp2);
+	assert(mem_nfree == freepages);
+
+	// Check the buddy allocator: blocks come out naturally aligned,
+	// smaller requests split the smallest block that fits,
+	// and freeing a block's pieces in any order merges it back together.
+	pp0 = mem_alloc_order(MEM_MAXORDER); assert(pp0 != 0);
+	assert(((pp0 - mem_pageinfo) & ((1 << MEM_MAXORDER) - 1)) == 0);
+	assert(mem_nfree == freepages - (1 << MEM_MAXORDER));
+	mem_stash_free(&st);
+	for (i = (1 << MEM_MAXORDER) - 1; i >= 0; i--)
+		mem_free(&pp0[i]);
+	assert(mem_nfree == 1 << MEM_MAXORDER);
+	assert(mem_buddy[MEM_MAXORDER] == pp0 && pp0->free_next == NULL);
+	pp1 = mem_alloc(); assert(pp1 == pp0);
+	pp2 = mem_alloc_order(1); assert(pp2 == pp0 + 2);
+	assert(mem_alloc_order(MEM_MAXORDER) == NULL);
+	assert(mem_nfree == (1 << MEM_MAXORDER) - 3);
+	mem_free_order(pp2, 1);
+	mem_free(pp1);
+	assert(mem_alloc_order(MEM_MAXORDER) == pp0);
+	assert(mem_alloc() == NULL);
+	mem_unstash_free(&st);
+	mem_free_order(pp0, MEM_MAXORDER);
+	assert(mem_nfree == freepages);
+
+	// Check the pre-zeroed pool: an idle-time page comes back blank,
+	// and an empty pool falls back to clearing a page on demand.
+	cpu *c = cpu_cur();
+	assert(mem_nzero == 0);
+	assert(mem_zero_idle());
+	assert(mem_nzero == 1 && mem_nfree == freepages - 1);
+	pp0 = mem_alloc_zero(); assert(pp0 != 0);
+	assert(c->zerohits == 1 && mem_nzero == 0);
+	for (i = 0; i < PAGESIZE; i++)
+		assert(((uint8_t*)mem_pi2ptr(pp0))[i] == 0);
+	pp1 = mem_alloc_zero(); assert(pp1 != 0 && pp1 != pp0);
+	assert(c->zeromisses == 1);
+	for (i = 0; i < PAGESIZE; i++)
+		assert(((uint8_t*)mem_pi2ptr(pp1))[i] == 0);
+	mem_free(pp0);
+	mem_free(pp1);
+	c->zerohits = c->zeromisses = 0;
+
+	// Now check the per-CPU magazine path:
+	// the first allocation refills the magazine in one batch,
+	// and a freed page is handed straight back by the next allocation.
+	assert(!mem_magazines && c->magcount == 0);
+	mem_magazines = 1;
+	pp0 = mem_alloc(); assert(pp0 != 0);
+	assert(c->magmisses == 1 && c->magcount == MEM_MAGBATCH-1);
+	pp1 = mem_alloc(); assert(pp1 != 0 && pp1 != pp0);
+	assert(c->maghits == 1 && c->magcount == MEM_MAGBATCH-2);
+	mem_free(pp1);
+	assert(c->magfrees == 1 && c->magcount == MEM_MAGBATCH-1);
+	assert(mem_alloc() == pp1);
+	mem_free(pp1);
+	mem_free(pp0);
+	assert(c->magcount == MEM_MAGBATCH);
+
+	// Overfill the magazine with pages from the global list:
+	// the free that finds it full should drain one batch back.
+	pageinfo *pps[MEM_MAGSIZE-MEM_MAGBATCH+1];
+	mem_magazines = 0;
+	for (i = 0; i < MEM_MAGSIZE-MEM_MAGBATCH+1; i++) {
+		pps[i] = mem_alloc(); assert(pps[i] != 0);
+	}
+	mem_magazines = 1;
+	for (i = 0; i < MEM_MAGSIZE-MEM_MAGBATCH+1; i++)
+		mem_free(pps[i]);
+	assert(c->magdrains == 1);
+	assert(c->magcount == MEM_MAGSIZE-MEM_MAGBATCH+1);
+	assert(mem_alloc() == pps[MEM_MAGSIZE-MEM_MAGBATCH]);
+
+	// Give everything back and leave the magazines off until later.
+	mem_magdrain(c, c->magcount);
+	mem_magazines = 0;
+	mem_free(pps[MEM_MAGSIZE-MEM_MAGBATCH]);
+	c->maghits = c->magmisses = c->magfrees = c->magdrains = 0;
 
 	cprintf("mem_check() succeeded!\n");
 }
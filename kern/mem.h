@@ -62,6 +62,7 @@
 #include <inc/assert.h>
 #include <inc/mmu.h>
 #include <inc/x86.h>
+#include <inc/vm.h>
 
 
 // At physical address MEM_IO (640K) there is a 384K hole for I/O.
@@ -90,6 +91,13 @@
 // The converse to the above: given a C pointer, return a physical address.
 #define mem_phys(ptr)		((uint32_t)(ptr))
 
+// Only physical memory below MEM_HIGH is mapped 1:1 as described above:
+// the last 4MB below VM_USERLO is the kmap window (see kern/pmap.h).
+// Pages from MEM_HIGH up are "highmem", which holds only user data
+// and which the kernel reaches through pmap_kmap() when it has to.
+#define MEM_HIGH	(VM_USERLO - PTSIZE)
+#define MEM_PHYSMAX	0xfffff000	// Last page we can map without PAE
+
 
 
 // A pageinfo struct holds metadata on how a particular physical page is used.
@@ -99,7 +107,11 @@
 // but that might make debugging a bit more challenging.
 typedef struct pageinfo {
 	struct pageinfo	*free_next;	// Next page number on free list
+	struct pageinfo	**free_prev;	// Link pointing to us on free list
 	int32_t	refcount;		// Reference count on allocated pages
+	uint8_t	free;			// Heads a free buddy block?
+	uint8_t	order;			// Buddy block is 2^order pages
+	uint16_t ptlive;		// Entries other than PTE_ZERO, if a page table
 } pageinfo;
 
 
@@ -107,6 +119,27 @@ typedef struct pageinfo {
 extern size_t mem_max;		// Maximum physical address
 extern size_t mem_npage;	// Total number of physical memory pages
 extern pageinfo *mem_pageinfo;	// Metadata array indexed by page number
+extern size_t mem_nfree;	// Pages on the buddy free lists
+extern size_t mem_lowwater;	// Reclaim when mem_nfree drops below this
+extern size_t mem_highwater;	// and keep reclaiming up to this
+
+// Free memory is kept in naturally aligned blocks of 2^order pages,
+// from single pages up to 4MB blocks (order MEM_MAXORDER),
+// so that PSE superpages can be backed by one physical block.
+#define MEM_MAXORDER	10
+#define MEM_ORDERS	(MEM_MAXORDER+1)
+
+// Each CPU keeps up to MEM_MAGSIZE free pages in a private magazine,
+// and moves MEM_MAGBATCH pages at a time to or from the global free list.
+#define MEM_MAGSIZE	32
+#define MEM_MAGBATCH	16
+
+// Idle CPUs keep up to this many free pages cleared in advance.
+#define MEM_ZEROMAX	256
+
+// Max number of registered memory reclaimers.
+#define MEM_RECLAIMERS	5
+
 
 // Convert between pageinfo pointers, page indexes, and physical page addresses
 #define mem_phys2pi(phys)	(&mem_pageinfo[(phys)/PAGESIZE])
@@ -132,6 +165,61 @@ pageinfo *mem_alloc(void);
 // Return a physical page to the free list.
 void mem_free(pageinfo *pi);
 
+// Allocate a naturally aligned block of 2^order contiguous pages,
+// or return NULL if no block that large is free.
+// Each page's refcount starts at zero, as with mem_alloc().
+pageinfo *mem_alloc_order(int order);
+
+// Free a block of 2^order pages, coalescing it with free buddies.
+// The pages of a block may also be freed one at a time with mem_free().
+void mem_free_order(pageinfo *pi, int order);
+
+// For the allocator self-checks: temporarily take away all free memory,
+// so a check can see exactly which pages it allocates and frees.
+typedef struct mem_stash {
+	pageinfo	*list[MEM_ORDERS];
+} mem_stash;
+void mem_stash_free(mem_stash *st);
+void mem_unstash_free(mem_stash *st);
+
+// Allocate a page for user data, which the kernel only touches
+// through user mappings or pmap_kmap(): comes from highmem if possible,
+// falling back on mem_alloc().
+pageinfo *mem_alloc_high(void);
+
+// Allocate a user data page whose contents are already all zero,
+// preferably from the pool of pages zeroed by idle CPUs.
+pageinfo *mem_alloc_zero(void);
+
+// Clear one free page into the pre-zeroed pool if it is not yet full.
+// Called from the idle loop; returns false if there was nothing to do.
+bool mem_zero_idle(void);
+
+// Free the highmem pages for use by mem_alloc_high().
+// Called once paging is on, since highmem is only reachable via pmap_kmap().
+void mem_highmem_init(void);
+
+// A reclaimer frees whatever memory it can spare from some cache,
+// stopping early once mem_nfree reaches 'target' pages.
+// Reclaimers must not allocate memory themselves.
+typedef void (*mem_reclaimer)(size_t target);
+
+// Add a reclaimer; they are tried in the order they were registered.
+void mem_reclaim_register(mem_reclaimer fn);
+
+// Run reclaimers until mem_nfree reaches 'target' or all of them have run.
+// Returns the number of pages freed.
+size_t mem_reclaim(size_t target);
+
+// Turn on the per-CPU page magazines in front of mem_alloc/mem_free.
+// They stay off until the allocator self-checks have run,
+// since those checks manipulate the global free list directly.
+void mem_magazine_init(void);
+
+// Print per-CPU page magazine, zero pool and reclaim statistics
+// and buddy fragmentation statistics.
+void mem_stats(void);
+
 extern uint8_t pmap_zero[PAGESIZE];	// for the asserts below
 
 
@@ -168,6 +256,10 @@ struct e820_mem_map {
 
 #define MEM_MAP_MAX 10
 
+// The physical memory map mem_init() found, for the boot-time summary.
+extern struct e820_mem_map mem_map[MEM_MAP_MAX];
+extern int mem_nmap;
+
 int detect_memory_e820(struct e820_mem_map m[MEM_MAP_MAX]); //returns number of memory map entries
 
 
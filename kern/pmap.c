@@ -21,6 +21,9 @@
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/pmap.h>
+#include <kern/swap.h>
+
+#include <dev/pit.h>
 
 
 // Statically allocated page directory mapping the kernel's address space.
@@ -30,6 +33,37 @@ pde_t pmap_bootpdir[1024] gcc_aligned(PAGESIZE);
 // Statically allocated page that we always keep set to all zeros.
 uint8_t pmap_zero[PAGESIZE] gcc_aligned(PAGESIZE);
 
+// Page table for the kmap window at PMAP_KMAPLO, shared by all pdirs.
+static pte_t pmap_kmapptab[NPTENTRIES] gcc_aligned(PAGESIZE);
+
+// One piece of a pmap_merge(): the range to merge, and what that found.
+typedef struct pmap_mergework {
+	pde_t		*rpdir, *spdir, *dpdir;
+	uint32_t	sva, dva, size;
+	mergestats	st;		// What merging the range involved
+	bool		ok;		// False if we ran out of memory
+} pmap_mergework;
+
+// A merge being shared out among idle CPUs.  Only one at a time:
+// a CPU that finds pmap_mergebusy taken just merges on its own.
+static spinlock pmap_mergebusy;
+static struct {
+	spinlock	lock;		// Protects the fields below
+	pmap_mergework	work[PMAP_MERGEWORK];
+	int		nwork;		// Pieces of the merge; 0 if none going
+	int		next;		// Next piece to hand out
+	int		ndone;		// Pieces finished
+	bool		failed;		// Some piece ran out of memory
+} pmap_mergejob;
+
+// Page tables unmapped by large pmap_remove()s, for idle CPUs to free.
+// Each holds the only reference to its page table.
+static spinlock pmap_deferlock;
+static pageinfo *pmap_deferq[PMAP_DEFERMAX];
+static int pmap_ndefer;
+
+static void pmap_deferreclaim(size_t target);
+
 
 // --------------------------------------------------------------
 // Set up initial memory mappings and turn on MMU.
@@ -49,12 +83,23 @@ void
 pmap_init(void)
 {
 	if (cpu_onboot()) {
-
-    	int a;
-    	for (a = 0; a < NPDENTRIES; a++)
-    		pmap_bootpdir[a] = (a << PDXSHIFT) | PTE_P | PTE_W | PTE_PS | PTE_G;
-    	for (a = PDX(VM_USERLO); a < PDX(VM_USERHI); a++)
-    		pmap_bootpdir[a] = PTE_ZERO;
+		// Direct-map all of physical memory with 4MB superpages,
+		// except for the user address range.
+		int a;
+		for (a = 0; a < NPDENTRIES; a++)
+			pmap_bootpdir[a] = (a << PDXSHIFT)
+				| PTE_P | PTE_W | PTE_PS | PTE_G;
+		for (a = PDX(VM_USERLO); a < PDX(VM_USERHI); a++)
+			pmap_bootpdir[a] = PTE_ZERO;
+
+		// Replace the top 4MB of the direct map with the kmap window.
+		pmap_bootpdir[PDX(PMAP_KMAPLO)] =
+			mem_phys(pmap_kmapptab) | PTE_P | PTE_W;
+
+		spinlock_init(&pmap_mergebusy);
+		spinlock_init(&pmap_mergejob.lock);
+		spinlock_init(&pmap_deferlock);
+		mem_reclaim_register(pmap_deferreclaim);
 	}
 
 	uint32_t cr4 = rcr4();
@@ -70,8 +115,34 @@ pmap_init(void)
 
 	// If we survived the lcr0, we're running with paging enabled.
 	// Now check the page table management functions below.
-	if (cpu_onboot())
+	if (cpu_onboot()) {
 		pmap_check();
+		pmap_mergecheck();
+	}
+}
+
+//
+// Map physical page 'pa' into this CPU's kmap slot 'slot',
+// unless it is directly mapped anyway.
+// No other CPU ever uses this CPU's slots,
+// so a local invlpg is all it takes to change a slot's mapping.
+//
+void *
+pmap_kmap(uint32_t pa, int slot)
+{
+	assert(PGOFF(pa) == 0);
+	assert(slot >= 0 && slot < PMAP_KMAPSLOTS);
+	if (pa < MEM_HIGH)
+		return mem_ptr(pa);
+
+	int i = cpu_cur()->id * PMAP_KMAPSLOTS + slot;
+	assert(i < NPTENTRIES);
+	void *va = mem_ptr(PMAP_KMAPLO + i * PAGESIZE);
+	if (PGADDR(pmap_kmapptab[i]) != pa) {
+		pmap_kmapptab[i] = pa | PTE_P | PTE_W;
+		invlpg(va);
+	}
+	return va;
 }
 
 //
@@ -102,19 +173,226 @@ pmap_freepdir(pageinfo *pdirpi)
 	mem_free(pdirpi);
 }
 
+// Take or drop the reference a PTE holds on a page or swap slot, if any.
+static void
+pmap_pteref(pte_t pte)
+{
+	if (pte & PTE_SWAP)
+		swap_incref(swap_slot(pte));
+	else if (PGADDR(pte) != PTE_ZERO)
+		mem_incref(mem_phys2pi(PGADDR(pte)));
+}
+
+static void
+pmap_pteunref(pte_t pte)
+{
+	if (pte & PTE_SWAP)
+		swap_decref(swap_slot(pte));
+	else if (PGADDR(pte) != PTE_ZERO)
+		mem_decref(mem_phys2pi(PGADDR(pte)), mem_free);
+}
+
 // Free a page table and all page mappings it may contain.
 void
 pmap_freeptab(pageinfo *ptabpi)
 {
 	pte_t *pte = mem_pi2ptr(ptabpi), *ptelim = pte + NPTENTRIES;
-	for (; pte < ptelim; pte++) {
-		uint32_t pgaddr = PGADDR(*pte);
-		if (pgaddr != PTE_ZERO)
-			mem_decref(mem_phys2pi(pgaddr), mem_free);
-	}
+	for (; pte < ptelim; pte++)
+		pmap_pteunref(*pte);
 	mem_free(ptabpi);
 }
 
+// Store 'val' in the page table entry 'pte', keeping count
+// of the live entries (those other than plain PTE_ZERO) in its table.
+static void
+pmap_setpte(pte_t *pte, pte_t val)
+{
+	pageinfo *ptabpi = mem_phys2pi(PGADDR(mem_phys(pte)));
+	ptabpi->ptlive += (val != PTE_ZERO) - (*pte != PTE_ZERO);
+	*pte = val;
+}
+
+// Does the PDE 'pde' map nothing, with or without a page table?
+static bool
+pmap_ptempty(pde_t pde)
+{
+	if (!(pde & PTE_P))
+		return 1;
+	return !(pde & PTE_PS) && mem_phys2pi(PGADDR(pde))->ptlive == 0;
+}
+
+// Free the page table at 'pde' if it is ours alone and maps nothing.
+static void
+pmap_ptabdrop(pde_t *pde)
+{
+	pageinfo *ptabpi = mem_phys2pi(PGADDR(*pde));
+	if (ptabpi->ptlive != 0 || ptabpi->refcount != 1)
+		return;
+	*pde = PTE_ZERO;
+	mem_decref(ptabpi, pmap_freeptab);
+}
+
+// Free the 4MB block backing a superpage.
+static void
+pmap_freesuper(pageinfo *pi)
+{
+	if (mem_pi2phys(pi) >= MEM_HIGH) {	// highmem has no buddy blocks
+		int i;
+		for (i = 0; i < NPTENTRIES; i++)
+			mem_free(&pi[i]);
+	} else
+		mem_free_order(pi, MEM_MAXORDER);
+}
+
+// Drop the reference a PDE holds on a page table or superpage, if any.
+static void
+pmap_pdeunref(pde_t pde)
+{
+	if (!(pde & PTE_P))
+		return;
+	if (pde & PTE_PS)
+		mem_decref(mem_phys2pi(PGADDR(pde)), pmap_freesuper);
+	else
+		mem_decref(mem_phys2pi(PGADDR(pde)), pmap_freeptab);
+}
+
+//
+// Queue the page table PDE 'pde' refers to for an idle CPU to free,
+// if we would otherwise free it and all its pages right now.
+// Not while reclaiming memory, which wants the pages back at once.
+// Returns false if the caller should drop the PDE's reference itself.
+//
+static bool
+pmap_defer(pde_t pde)
+{
+	if (!(pde & PTE_P) || (pde & PTE_PS) || cpu_cur()->reclaiming)
+		return 0;
+	pageinfo *ptabpi = mem_phys2pi(PGADDR(pde));
+	if (ptabpi->refcount != 1 || ptabpi->ptlive == 0)
+		return 0;	// nothing much to free
+
+	spinlock_acquire(&pmap_deferlock);
+	bool queued = pmap_ndefer < PMAP_DEFERMAX;
+	if (queued)
+		pmap_deferq[pmap_ndefer++] = ptabpi;
+	spinlock_release(&pmap_deferlock);
+	if (queued)
+		cpu_wake(1);
+	return queued;
+}
+
+// Take a page table off the deferred queue, or return NULL if none.
+static pageinfo *
+pmap_deferpop(void)
+{
+	pageinfo *ptabpi = NULL;
+	spinlock_acquire(&pmap_deferlock);
+	if (pmap_ndefer > 0)
+		ptabpi = pmap_deferq[--pmap_ndefer];
+	spinlock_release(&pmap_deferlock);
+	return ptabpi;
+}
+
+// Called from the idle loop: free one deferred page table and its pages.
+// Returns false if there was nothing to do.
+bool
+pmap_deferidle(void)
+{
+	if (pmap_ndefer == 0)		// nothing queued: don't take the lock
+		return 0;
+	pageinfo *ptabpi = pmap_deferpop();
+	if (ptabpi == NULL)
+		return 0;
+	mem_decref(ptabpi, pmap_freeptab);
+	cpu_cur()->teardowns++;
+	return 1;
+}
+
+// Memory reclaimer: don't wait for idle CPUs to free deferred page tables.
+static void
+pmap_deferreclaim(size_t target)
+{
+	pageinfo *ptabpi;
+	while (mem_nfree < target && (ptabpi = pmap_deferpop()) != NULL)
+		mem_decref(ptabpi, pmap_freeptab);
+}
+
+//
+// Split the superpage mapping the 4MB region containing 'va' in 'pdir'
+// into a page table mapping the same pages, with the same permissions.
+// Superpages are never shared, so each page of the 4MB block
+// simply gets a reference of its own, and is later freed on its own.
+// Returns false if there's no memory for the page table.
+//
+static bool
+pmap_demote(pde_t *pdir, uint32_t va)
+{
+	pde_t *pde = &pdir[PDX(va)];
+	assert(*pde & PTE_PS);
+	pageinfo *ptabpi = mem_alloc();
+	if (ptabpi == NULL)
+		return 0;
+	mem_incref(ptabpi);
+
+	pageinfo *pi = mem_phys2pi(PGADDR(*pde));
+	assert(pi->refcount == 1);
+	uint32_t perm = *pde & (SYS_RW | PTE_A | PTE_D | PTE_U | PTE_W | PTE_P);
+	pte_t *ptab = mem_pi2ptr(ptabpi);
+	int i;
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (i > 0)
+			mem_incref(&pi[i]);
+		ptab[i] = mem_pi2phys(&pi[i]) | perm;
+	}
+	ptabpi->ptlive = NPTENTRIES;
+	*pde = mem_pi2phys(ptabpi) | PTE_A | PTE_P | PTE_W | PTE_U;
+
+	// The TLB must not hold both sizes of mapping for one address.
+	pmap_inval(pdir, PTADDR(va), PTSIZE);
+	cpu_cur()->supersplits++;
+	return 1;
+}
+
+//
+// Try to map the 4MB region containing 'va' in 'pdir' with a superpage.
+// That works if every page in it is present, private and writable,
+// with the same permissions, and the pages already lie in order
+// in one naturally aligned 4MB block of physical memory:
+// the block then takes over the pages, and we free their page table.
+// Nothing is copied or allocated, so a region that doesn't line up
+// simply stays made of pages.
+//
+static void
+pmap_promote(pde_t *pdir, uint32_t va)
+{
+	pde_t *pde = &pdir[PDX(va)];
+	if (!(*pde & PTE_P) || (*pde & PTE_PS) || !(*pde & PTE_W))
+		return;
+	pageinfo *ptabpi = mem_phys2pi(PGADDR(*pde));
+	if (ptabpi->refcount != 1)
+		return;
+	pte_t *ptab = mem_pi2ptr(ptabpi);
+	uint32_t base = PGADDR(ptab[0]);
+	if (base % PTSIZE != 0 || base == PTE_ZERO)
+		return;
+	uint32_t perm = SYS_RW | PTE_U | PTE_W | PTE_P;
+	int i;
+	for (i = 0; i < NPTENTRIES; i++)
+		if ((ptab[i] & (SYS_RW | PTE_U | PTE_W | PTE_P)) != perm
+				|| PGADDR(ptab[i]) != base + i*PAGESIZE
+				|| mem_phys2pi(PGADDR(ptab[i]))->refcount != 1)
+			return;
+
+	// Like any superpage, the block is referenced through its first page.
+	pageinfo *pi = mem_phys2pi(base);
+	for (i = 1; i < NPTENTRIES; i++)
+		pi[i].refcount = 0;
+	*pde = base | perm | PTE_PS | PTE_A | PTE_D;
+	mem_decref(ptabpi, mem_free);
+	pmap_inval(pdir, PTADDR(va), PTSIZE);
+	cpu_cur()->superpages++;
+}
+
 // Given 'pdir', a pointer to a page directory, pmap_walk returns
 // a pointer to the page table entry (PTE) for user virtual address 'va'.
 // This requires walking the two-level page table structure.
@@ -131,6 +409,9 @@ pmap_freeptab(pageinfo *ptabpi)
 // but it is read shared and writing != 0, then copy the page table
 // to obtain an exclusive copy of it and write-enable the PDE.
 //
+// If the region is mapped by a superpage, there is no page table:
+// with writing != 0 we split the superpage into one, else return NULL.
+//
 // Hint: you can turn a pageinfo pointer into the physical address of the
 // page it refers to with mem_pi2phys() from kern/mem.h.
 //
@@ -145,6 +426,8 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
   uint32_t la = va;
   pde_t *pde = &pdir[PDX(la)];
   pte_t *ptab;
+  if ((*pde & PTE_PS) && (!writing || !pmap_demote(pdir, la)))
+    return NULL;	// no page table until we split the superpage
   if (*pde & PTE_P)
   {
   	ptab = mem_ptr(PGADDR(*pde));
@@ -161,6 +444,7 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
   int i;
   for (i = 0; i < NPTENTRIES; i++)
   	ptab[i] = PTE_ZERO;
+  pi->ptlive = 0;
 
   *pde = mem_pi2phys(pi) | PTE_A | PTE_P | PTE_W | PTE_U;
   }
@@ -187,9 +471,9 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
     			uint32_t pte = ptab[i];
     			nptab[i] = pte & ~PTE_W;
     			assert(PGADDR(pte) != 0);
-    			if (PGADDR(pte) != PTE_ZERO)
-    				mem_incref(mem_phys2pi(PGADDR(pte)));
+    			pmap_pteref(pte);
     		}
+    		pi->ptlive = mem_ptr2pi(ptab)->ptlive;
 
     	mem_decref(mem_ptr2pi(ptab), pmap_freeptab);
     	ptab = nptab;
@@ -231,10 +515,13 @@ pmap_insert(pde_t *pdir, pageinfo *pi, uint32_t va, int perm)
 
   mem_incref(pi);
 
-  if (*pte & PTE_P)
-    pmap_remove(pdir, va, PAGESIZE);
+  // Not pmap_remove(): that could free the page table under us.
+  if (*pte & (PTE_P | PTE_SWAP)) {
+    pmap_pteunref(*pte);
+    pmap_inval(pdir, va, PAGESIZE);
+  }
 
-  *pte = mem_pi2phys(pi) | perm | PTE_P;
+  pmap_setpte(pte, mem_pi2phys(pi) | perm | PTE_P);
 
   return pte;
 }
@@ -251,10 +538,13 @@ pmap_insert(pde_t *pdir, pageinfo *pi, uint32_t va, int perm)
 //   - The physical page should be freed if the refcount reaches 0.
 //   - The page table entry corresponding to 'va' should be set to 0.
 //     (if such a PTE exists)
+//   - A page table left with no live entries is freed, if not shared.
 //   - The TLB must be invalidated if you remove an entry from
 //     the pdir/ptab.
 //   - If the region to remove covers a whole 4MB page table region,
 //     then unmap and free the page table after unmapping all its contents.
+//     For a region of PMAP_DEFERMIN bytes or more, just unmap the table,
+//     and leave freeing it to an idle CPU (see pmap_deferidle()).
 //
 // Hint: The TA solution is implemented using pmap_lookup,
 // 	pmap_inval, and mem_decref.
@@ -268,6 +558,7 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
 
   pmap_inval(pdir, va, size);
 
+  bool defer = size >= PMAP_DEFERMIN;
   uint32_t vahi = va + size;
   while (va < vahi)
   {
@@ -280,9 +571,8 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
 
   	if (PTX(va) == 0 && vahi-va >= PTSIZE)
   	{
-  		uint32_t ptabaddr = PGADDR(*pde);
-    		if(ptabaddr != PTE_ZERO)
-      			mem_decref(mem_phys2pi(ptabaddr), pmap_freeptab);
+		if (!defer || !pmap_defer(*pde))
+			pmap_pdeunref(*pde);
       		*pde = PTE_ZERO;
       		va += PTSIZE;
       		continue;
@@ -293,12 +583,11 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
 	
   	do
   	{
-  		uint32_t pgaddr = PGADDR(*pte);
-  		if(pgaddr != PTE_ZERO)
-  			mem_decref(mem_phys2pi(pgaddr), mem_free);
-      		*pte++ = PTE_ZERO;
+  		pmap_pteunref(*pte);
+      		pmap_setpte(pte++, PTE_ZERO);
       		va += PAGESIZE;
   	} while (va < vahi && PTX(va) != 0);
+  	pmap_ptabdrop(pde);
   }
 }
 
@@ -306,33 +595,93 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
 // Invalidate the TLB entry or entries for a given virtual address range,
 // but only if the page tables being edited are the ones
 // currently in use by the processor.
+// Ranges of up to PMAP_INVALMAX pages are invalidated a page at a time;
+// larger ones flush the whole TLB (except global kernel mappings).
+// Between pmap_invalbegin() and pmap_invalflush(), the work is deferred,
+// so a system call making several changes flushes the TLB at most once.
 //
 void
 pmap_inval(pde_t *pdir, uint32_t va, size_t size)
 {
-	// Flush the entry only if we're modifying the current address space.
-	proc *p = proc_cur();
-	if (p == NULL || p->pdir == pdir) {
-		if (size == PAGESIZE)
-			invlpg(mem_ptr(va));	// invalidate one page
-		else
-			lcr3(mem_phys(pdir));	// invalidate everything
+	// proc_cur() may be stale on an idle CPU, so check CR3 itself.
+	if (mem_phys(pdir) != PGADDR(rcr3()))
+		return;
+
+	cpu *c = cpu_cur();
+	uint32_t npages = ROUNDUP(PGOFF(va) + size, PAGESIZE) / PAGESIZE;
+	va = ROUNDDOWN(va, PAGESIZE);
+	if (c->invbatch) {
+		if (c->invall || c->ninval + npages > PMAP_INVALMAX) {
+			c->invall = 1;
+			return;
+		}
+		for (; npages > 0; npages--, va += PAGESIZE)
+			c->invva[c->ninval++] = va;
+		return;
+	}
+
+	if (npages > PMAP_INVALMAX) {
+		lcr3(mem_phys(pdir));	// invalidate everything
+		c->tlbflushes++;
+		return;
 	}
+	c->tlbinvlpgs += npages;
+	for (; npages > 0; npages--, va += PAGESIZE)
+		invlpg(mem_ptr(va));
+}
+
+// Defer pmap_inval()s on this CPU until pmap_invalflush().
+// The kernel must not touch user memory in the meantime.
+void
+pmap_invalbegin(void)
+{
+	pmap_invalflush();	// in case an earlier batch was left open
+	cpu_cur()->invbatch = 1;
+}
+
+// Do the invalidations deferred since pmap_invalbegin(), if any.
+void
+pmap_invalflush(void)
+{
+	cpu *c = cpu_cur();
+	if (!c->invbatch)
+		return;
+	if (c->invall) {
+		lcr3(PGADDR(rcr3()));
+		c->tlbflushes++;
+	} else {
+		int i;
+		for (i = 0; i < c->ninval; i++)
+			invlpg(mem_ptr(c->invva[i]));
+		c->tlbinvlpgs += c->ninval;
+	}
+	pmap_invalcancel();
+}
+
+// Forget deferred invalidations: we're about to load CR3 anyway.
+void
+pmap_invalcancel(void)
+{
+	cpu *c = cpu_cur();
+	c->invbatch = c->invall = 0;
+	c->ninval = 0;
 }
 
 //
 // Virtually copy a range of pages from spdir to dpdir (could be the same).
 // Uses copy-on-write to avoid the cost of immediate copying:
 // instead just copies the mappings and makes both source and dest read-only.
+// Where source and destination line up on whole 4MB page tables,
+// the page tables themselves are shared; elsewhere we copy PTEs.
 // Returns true if successfull, false if not enough memory for copy.
 //
 int
 pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 		size_t size)
 {
-	assert(PTOFF(sva) == 0);	// must be 4MB-aligned
-	assert(PTOFF(dva) == 0);
-	assert(PTOFF(size) == 0);
+	assert(PGOFF(sva) == 0);	// must be page-aligned
+	assert(PGOFF(dva) == 0);
+	assert(PGOFF(size) == 0);
 	assert(sva >= VM_USERLO && sva < VM_USERHI);
 	assert(dva >= VM_USERLO && dva < VM_USERHI);
 	assert(size <= VM_USERHI - sva);
@@ -342,25 +691,96 @@ pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 	pmap_inval(dpdir, dva, size);
 
 	uint32_t svahi = sva + size;
-	pde_t *spde = &spdir[PDX(sva)];
-	pte_t *dpde = &dpdir[PDX(dva)];
-
-	while (sva < svahi)
-	{
-		if (*dpde & PTE_P)
-			pmap_remove(dpdir, dva, PTSIZE);
-		assert(*dpde == PTE_ZERO);
-		*spde &= ~PTE_W;
-		*dpde = *spde;
+	while (sva < svahi) {
+		pde_t *spde = &spdir[PDX(sva)];
+		pde_t *dpde = &dpdir[PDX(dva)];
+
+		// Copy-on-write sharing splits superpages, which are private.
+		if ((*spde & PTE_PS) && !pmap_demote(spdir, sva))
+			return 0;
+
+		if (PTOFF(sva) == 0 && PTOFF(dva) == 0 && svahi - sva >= PTSIZE) {
+			*spde &= ~PTE_W;
+			if ((*spde & PTE_P) && PGADDR(*dpde) == PGADDR(*spde)) {
+				*dpde = *spde;	// already sharing this table
+				sva += PTSIZE;
+				dva += PTSIZE;
+				continue;
+			}
+			if (*dpde & PTE_P)
+				pmap_remove(dpdir, dva, PTSIZE);
+			assert(*dpde == PTE_ZERO);
+			*dpde = *spde;
+
+			if (*spde != PTE_ZERO)
+				mem_incref(mem_phys2pi(PGADDR(*spde)));
+
+			sva += PTSIZE;
+			dva += PTSIZE;
+			continue;
+		}
+
+		// Copy PTEs up to the end of the source or destination table.
+		uint32_t n = MIN(svahi - sva,
+				MIN(PTSIZE - PTOFF(sva), PTSIZE - PTOFF(dva)));
+		if (pmap_ptempty(*spde) && pmap_ptempty(*dpde)) {
+			sva += n, dva += n;	// nothing there to copy over
+			continue;
+		}
+		pte_t *dpte = pmap_walk(dpdir, dva, 1);
+		if (dpte == NULL)
+			return 0;
+		pte_t *spte = (*spde & PTE_P)
+				? &((pte_t*)mem_ptr(PGADDR(*spde)))[PTX(sva)]
+				: NULL;
+		for (; n > 0; n -= PAGESIZE, sva += PAGESIZE, dva += PAGESIZE) {
+			pte_t pte = PTE_ZERO;
+			if (spte != NULL) {
+				*spte &= ~PTE_W;
+				pte = *spte++;
+			}
+			pmap_pteref(pte);
+			pmap_pteunref(*dpte);
+			pmap_setpte(dpte++, pte);
+		}
+		pmap_ptabdrop(dpde);
+	}
 
-		if (*spde != PTE_ZERO)
-			mem_incref(mem_phys2pi(PGADDR(*spde)));
+	return 1;
+}
 
-		spde++, dpde++;
-		sva += PTSIZE;
-		dva += PTSIZE;
+//
+// Make the copy-on-write or zero page at 'pte' writable,
+// copying it first unless nothing else refers to it.
+// Returns false if there is no memory for the copy.
+//
+static bool
+pmap_cowpage(pte_t *pte)
+{
+	uint32_t pg = PGADDR(*pte);
+	if(pg == PTE_ZERO)
+	{
+		// A first write to a zero page: take a page that's already blank.
+		pageinfo *npi = mem_alloc_zero();
+		if (npi == NULL)
+			return 0;
+		mem_incref(npi);
+		pg = mem_pi2phys(npi);
 	}
-	
+	else if(mem_phys2pi(pg)->refcount > 1)
+	{
+		pageinfo *npi = mem_alloc_high();
+		if (npi == NULL)
+			return 0;
+		mem_incref(npi);
+		uint32_t npg = mem_pi2phys(npi);
+		memmove(pmap_kmap(npg, PMAP_KMAP_DST),
+			pmap_kmap(pg, PMAP_KMAP_SRC), PAGESIZE);
+		mem_decref(mem_phys2pi(pg), mem_free);
+		pg = npg;
+	}
+
+	*pte = pg | SYS_RW | PTE_A | PTE_D | PTE_W | PTE_U | PTE_P;
 	return 1;
 }
 
@@ -371,13 +791,20 @@ pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 // If the fault wasn't due to the kernel's copy on write optimization,
 // however, this function just returns so the trap gets blamed on the user.
 //
+// A write fault just past the pages the process's last one resolved
+// looks like a sequential writer, so we resolve a window of the
+// copy-on-write pages after it too: the window doubles with each
+// sequential fault, up to PMAP_FAULTMAX pages, and drops back to one
+// page on any other fault.  It stops at the end of the page table,
+// at the first page that isn't copy-on-write, or when memory runs low.
+//
 void
 pmap_pagefault(trapframe *tf)
 {
 
 	uint32_t fva = rcr2();
 
-	if (fva < VM_USERLO || fva >= VM_USERHI || !(tf->err & PFE_WR))
+	if (fva < VM_USERLO || fva >= VM_USERHI)
 	{
 		cprintf("pmap_pagefault: fva %x err %x\n", fva, tf->err);
 		return;
@@ -391,8 +818,41 @@ pmap_pagefault(trapframe *tf)
 		cprintf("pmap_pagefault: pde for fva %x does not exist\n", fva);
 		return;
 	}
+	if (*pde & PTE_PS)	// superpages are never copy-on-write
+	{
+		cprintf("pmap_pagefault: fva %x err %x in superpage\n",
+			fva, tf->err);
+		return;
+	}
 
+	// Only writes fault on present pages, but any access can fault
+	// on a readable page that's out on swap.
+	if (!(tf->err & PFE_WR)) {
+		pte_t *pte = pmap_walk(p->pdir, fva, 0);
+		if (pte == NULL || !(*pte & PTE_SWAP) || !(*pte & SYS_READ)) {
+			cprintf("pmap_pagefault: fva %x err %x\n",
+				fva, tf->err);
+			return;
+		}
+	}
+
+	// If we can't get the memory to handle the fault,
+	// reflect a T_NOMEM trap to the parent instead.
 	pte_t *pte = pmap_walk(p->pdir, fva, 1);
+	if (pte == NULL) {
+		tf->trapno = T_NOMEM;
+		return;
+	}
+	if ((*pte & PTE_SWAP) && (*pte & SYS_READ)) {
+		if (!swap_in(pte)) {
+			tf->trapno = T_NOMEM;
+			return;
+		}
+		if (!(tf->err & PFE_WR) || (*pte & PTE_W)) {
+			pmap_inval(p->pdir, PGADDR(fva), PAGESIZE);
+			trap_return(tf);
+		}
+	}
 	if((*pte & (SYS_READ | SYS_WRITE | PTE_P)) != (SYS_READ | SYS_WRITE | PTE_P))
 	{
 		cprintf("pmap_pagefault: page for fva %x does not exist\n", fva);
@@ -401,129 +861,473 @@ pmap_pagefault(trapframe *tf)
 
 	assert(!(*pte & PTE_W));
 
-	uint32_t pg = PGADDR(*pte);
-	if(pg == PTE_ZERO || mem_phys2pi(pg)->refcount > 1)
-	{
-		pageinfo *npi = mem_alloc();
-		assert(npi);
-		mem_incref(npi);
-		uint32_t npg = mem_pi2phys(npi);
-		memmove((void*)npg, (void*)pg, PAGESIZE);
-		if(pg != PTE_ZERO)
-			mem_decref(mem_phys2pi(pg), mem_free);
-		pg = npg;
+	bool fresh = PGADDR(*pte) == PTE_ZERO;	// not a copy-on-write copy
+	if (!pmap_cowpage(pte)) {
+		tf->trapno = T_NOMEM;
+		return;
 	}
 
-	*pte = pg | SYS_RW | PTE_A | PTE_D | PTE_W | PTE_U | PTE_P;
-
-	pmap_inval(p->pdir, PGADDR(fva), PAGESIZE);
+	uint32_t va = PGADDR(fva);
+	p->faultwin = va == p->faultnext
+			? MIN(p->faultwin * 2, PMAP_FAULTMAX) : 1;
+	uint32_t n = 1;
+	while (n < p->faultwin && PTX(va + n*PAGESIZE) != 0
+			&& mem_nfree > mem_lowwater
+			&& (pte[n] & (SYS_RW | PTE_P | PTE_W)) == (SYS_RW | PTE_P)
+			&& pmap_cowpage(&pte[n]))
+		n++;
+	p->faultnext = va + n*PAGESIZE;
+	p->faults++;
+	p->faultpages += n;
+
+	pmap_inval(p->pdir, va, n*PAGESIZE);
+
+	// Filling a fresh 4MB region in order, either way, ends with a fault
+	// on its first or last page: only then see if it can be a superpage.
+	// Regions being copied on write, as after every fork, aren't worth it:
+	// the next fork would only split them again.
+	if (fresh && (PTX(va) == 0 || PTX(va + (n-1)*PAGESIZE) == NPTENTRIES-1))
+		pmap_promote(p->pdir, va);
 	trap_return(tf);
 }
 
+// Let the kernel use registers %xmm0-%xmm7 for a moment.
+// We don't save FPU state on entry to the kernel, so if the FPU is live
+// (CR0_TS clear), the registers hold some process's state: save them.
+// The kernel stack needn't be 16-byte aligned, hence the movdqu's.
+typedef struct pmap_xmmsave {
+	uint8_t		xmm[8][16];
+	uint32_t	cr0;
+} pmap_xmmsave;
+
+static void
+pmap_xmmbegin(pmap_xmmsave *xs)
+{
+	xs->cr0 = rcr0();
+	if (xs->cr0 & CR0_TS) {
+		lcr0(xs->cr0 & ~CR0_TS);
+		return;
+	}
+	asm volatile(
+		"movdqu %%xmm0,0x00(%0); movdqu %%xmm1,0x10(%0);"
+		"movdqu %%xmm2,0x20(%0); movdqu %%xmm3,0x30(%0);"
+		"movdqu %%xmm4,0x40(%0); movdqu %%xmm5,0x50(%0);"
+		"movdqu %%xmm6,0x60(%0); movdqu %%xmm7,0x70(%0);"
+		: : "r" (xs->xmm) : "memory");
+}
+
+static void
+pmap_xmmend(pmap_xmmsave *xs)
+{
+	if (xs->cr0 & CR0_TS) {
+		lcr0(xs->cr0);
+		return;
+	}
+	asm volatile(
+		"movdqu 0x00(%0),%%xmm0; movdqu 0x10(%0),%%xmm1;"
+		"movdqu 0x20(%0),%%xmm2; movdqu 0x30(%0),%%xmm3;"
+		"movdqu 0x40(%0),%%xmm4; movdqu 0x50(%0),%%xmm5;"
+		"movdqu 0x60(%0),%%xmm6; movdqu 0x70(%0),%%xmm7;"
+		: : "r" (xs->xmm) : "memory");
+}
+
+// Three-way merge of one page, a byte at a time: the original version
+// of pmap_mergediff() below, kept to check and benchmark it against.
+static bool
+pmap_mergediff_bytes(const uint8_t *rpg, const uint8_t *spg, uint8_t *dpg)
+{
+	int i;
+	for (i = 0; i < PAGESIZE; i++) {
+		if (spg[i] == rpg[i])
+			continue;
+		if (dpg[i] != rpg[i])
+			return 0;
+		dpg[i] = spg[i];
+	}
+	return 1;
+}
+
+//
+// Copy into dpg every byte that changed from rpg to spg.
+// Returns false if a changed byte also changed in dpg: a conflict.
+// Usually only a few bytes of the page changed, so first skip 64-byte
+// blocks that are the same in rpg and spg, comparing 16 bytes at a time
+// with SSE2, and only merge the blocks that differ, also with SSE2:
+// where s == r keep d; elsewhere d must have been r, and becomes s.
+// All three pages are page-aligned, so aligned loads are fine.
+//
+static bool
+pmap_mergediff(const uint8_t *rpg, const uint8_t *spg, uint8_t *dpg)
+{
+	pmap_xmmsave xs;
+	pmap_xmmbegin(&xs);
+
+	bool ok = 1;
+	int i, j;
+	for (i = 0; i < PAGESIZE && ok; i += 64) {
+		int same;
+		asm volatile(
+			"movdqa 0x00(%1),%%xmm0; pcmpeqb 0x00(%2),%%xmm0;"
+			"movdqa 0x10(%1),%%xmm1; pcmpeqb 0x10(%2),%%xmm1;"
+			"movdqa 0x20(%1),%%xmm2; pcmpeqb 0x20(%2),%%xmm2;"
+			"movdqa 0x30(%1),%%xmm3; pcmpeqb 0x30(%2),%%xmm3;"
+			"pand %%xmm1,%%xmm0; pand %%xmm3,%%xmm2;"
+			"pand %%xmm2,%%xmm0; pmovmskb %%xmm0,%0"
+			: "=r" (same) : "r" (rpg+i), "r" (spg+i) : "memory");
+		if (same == 0xffff)
+			continue;
+
+		for (j = i; j < i+64; j += 16) {
+			int ours;
+			asm volatile(
+				"movdqa (%1),%%xmm4;"		// r
+				"movdqa (%2),%%xmm5;"		// s
+				"movdqa (%3),%%xmm6;"		// d
+				"movdqa %%xmm5,%%xmm7;"
+				"pcmpeqb %%xmm4,%%xmm7;"	// s == r
+				"pcmpeqb %%xmm6,%%xmm4;"	// d == r
+				"por %%xmm7,%%xmm4;"
+				"pmovmskb %%xmm4,%0;"		// ...either
+				"pand %%xmm7,%%xmm6;"		// d where s == r
+				"pandn %%xmm5,%%xmm7;"		// s where s != r
+				"por %%xmm7,%%xmm6;"
+				"movdqa %%xmm6,(%3)"
+				: "=r" (ours)
+				: "r" (rpg+j), "r" (spg+j), "r" (dpg+j)
+				: "memory");
+			if (ours != 0xffff) {	// the page is dropped anyway
+				ok = 0;
+				break;
+			}
+		}
+	}
+
+	pmap_xmmend(&xs);
+	return ok;
+}
+
+// Reach the page a reference or source PTE maps for pmap_mergepage(),
+// through kmap slot 'slot' or in a temporary page *tmp if it's swapped out.
+static uint8_t *
+pmap_mergemap(pte_t pte, int slot, pageinfo **tmp)
+{
+	if (!(pte & PTE_SWAP))
+		return pmap_kmap(PGADDR(pte), slot);
+	if ((*tmp = mem_alloc()) == NULL)
+		return NULL;
+	swap_read(swap_slot(pte), mem_pi2ptr(*tmp));
+	return mem_pi2ptr(*tmp);
+}
+
+// Merge the bytes that changed from rpg to spg into the page at dpte.
+static bool
+pmap_mergebytes(uint8_t *rpg, uint8_t *spg, pte_t *dpte, uint32_t dva,
+		pmap_mergework *w)
+{
+	uint32_t dpa = PGADDR(*dpte);
+	uint8_t *dpg;
+
+	// A zero destination page is merged into like any other:
+	// it may be zero only because dedup found it so.
+	if (dpa == PTE_ZERO || mem_phys2pi(dpa)->refcount > 1) {
+		pageinfo *npi = mem_alloc_high();	// copy before modifying
+		if (npi == NULL)
+			return 0;
+		mem_incref(npi);
+		dpg = pmap_kmap(mem_pi2phys(npi), PMAP_KMAP_DST);
+		memmove(dpg, pmap_kmap(dpa, PMAP_KMAP_TMP), PAGESIZE);
+		pmap_pteunref(*dpte);
+		pmap_setpte(dpte, mem_pi2phys(npi) | SYS_RW | PTE_A | PTE_D
+				| PTE_W | PTE_U | PTE_P);
+	} else
+		dpg = pmap_kmap(dpa, PMAP_KMAP_DST);
+
+	w->st.diffed += PAGESIZE;
+	if (!pmap_mergediff(rpg, spg, dpg)) {
+		if (w->st.nconflict < MSTATS_CONFLICTS)
+			w->st.conflicts[w->st.nconflict] = dva;
+		w->st.nconflict++;
+		mem_decref(mem_phys2pi(PGADDR(*dpte)), mem_free);
+		pmap_setpte(dpte, PTE_ZERO);
+	}
+	return 1;
+}
+
 //
 // Helper function for pmap_merge: merge a single memory page
 // that has been modified in both the source and destination.
 // If conflicting writes to a single byte are detected on the page,
-// print a warning to the console and remove the page from the destination.
+// note the conflict in w->st and remove the page from the destination.
 // If the destination page is read-shared, be sure to copy it before modifying!
+// Returns false if there was no memory for that copy.
 //
-void
-pmap_mergepage(pte_t *rpte, pte_t *spte, pte_t *dpte, uint32_t dva)
+static bool
+pmap_mergepage(pte_t *rpte, pte_t *spte, pte_t *dpte, uint32_t dva,
+		pmap_mergework *w)
 {
-  uint8_t *rpg = (uint8_t*)PGADDR(*rpte);
+	// The destination page table is ours alone,
+	// so a swapped-out destination page can just be swapped back in.
+	if ((*dpte & PTE_SWAP) && !swap_in(dpte))
+		return 0;
+
+	// Swapped-out reference and source pages are only read,
+	// and their page tables may be shared: read them into temporaries.
+	pageinfo *rtmp = NULL, *stmp = NULL;
+	uint8_t *rpg = pmap_mergemap(*rpte, PMAP_KMAP_REF, &rtmp);
+	uint8_t *spg = rpg ? pmap_mergemap(*spte, PMAP_KMAP_SRC, &stmp) : NULL;
+	bool ok = spg != NULL && pmap_mergebytes(rpg, spg, dpte, dva, w);
+	if (rtmp != NULL)
+		mem_free(rtmp);
+	if (stmp != NULL)
+		mem_free(stmp);
+	return ok;
+}
 
-  uint8_t *spg = (uint8_t*)PGADDR(*spte);
+//
+// Merge one page from the source into the destination,
+// given the PTEs mapping it in the reference, source and destination.
+// Returns false if there was no memory to do so.
+//
+static bool
+pmap_mergepte(pte_t *rpte, pte_t *spte, pte_t *dpte, uint32_t dva,
+		pmap_mergework *w)
+{
+	if (*spte == *rpte)		// unchanged in the source
+		return 1;
+	if (*dpte == *rpte) {		// unchanged in the dest: just copy
+		*spte &= ~PTE_W;
+		pmap_pteref(*spte);
+		pmap_pteunref(*dpte);
+		pmap_setpte(dpte, *spte);
+		w->st.copied++;
+		return 1;
+	}
+	return pmap_mergepage(rpte, spte, dpte, dva, w);
+}
 
-  uint8_t *dpg = (uint8_t*)PGADDR(*dpte);
-  if(dpg == pmap_zero) return;
+//
+// Merge the range described by 'w', setting w->ok to false
+// if we run out of memory part way.
+// Whole 4MB page tables that are unchanged in the source are skipped,
+// and those unchanged in the destination copied, where the regions
+// line up on them; everything else is merged a page at a time.
+//
+static void
+pmap_mergerange(pmap_mergework *w)
+{
+	pde_t *rpdir = w->rpdir, *spdir = w->spdir, *dpdir = w->dpdir;
+	uint32_t sva = w->sva, dva = w->dva, svahi = w->sva + w->size;
+	memset(&w->st, 0, sizeof(w->st));
+	w->ok = 0;
+	while (sva < svahi) {
+		pde_t *rpde = &rpdir[PDX(sva)];
+		pde_t *spde = &spdir[PDX(sva)];
+		pde_t *dpde = &dpdir[PDX(dva)];
+		uint32_t n = MIN(svahi - sva,
+				MIN(PTSIZE - PTOFF(sva), PTSIZE - PTOFF(dva)));
+
+		if (*spde == *rpde		// nothing changed in the source
+				|| (pmap_ptempty(*spde) && pmap_ptempty(*rpde))) {
+			sva += n, dva += n;
+			continue;
+		}
+		if ((*spde & PTE_PS) && !pmap_demote(spdir, sva))
+			return;
+		if (n == PTSIZE && *dpde == *rpde) {
+			if (*spde & PTE_P)
+				w->st.copied += mem_phys2pi(PGADDR(*spde))->ptlive;
+			if (!pmap_copy(spdir, sva, dpdir, dva, PTSIZE))
+				return;
+			sva += PTSIZE, dva += PTSIZE;
+			continue;
+		}
+
+		pte_t *dpte = pmap_walk(dpdir, dva, 1);
+		if (dpte == NULL)
+			return;
+		w->st.scanned += n / PAGESIZE;
+		pte_t *rptab = (*rpde & PTE_P) ? mem_ptr(PGADDR(*rpde)) : NULL;
+		pte_t *sptab = (*spde & PTE_P) ? mem_ptr(PGADDR(*spde)) : NULL;
+		for (; n > 0; n -= PAGESIZE, sva += PAGESIZE, dva += PAGESIZE) {
+			pte_t rzero = PTE_ZERO, szero = PTE_ZERO;
+			pte_t *rpte = rptab ? &rptab[PTX(sva)] : &rzero;
+			pte_t *spte = sptab ? &sptab[PTX(sva)] : &szero;
+			if (!pmap_mergepte(rpte, spte, dpte++, dva, w))
+				return;
+		}
+		pmap_ptabdrop(dpde);
+	}
+	w->ok = 1;
+}
 
-  if(dpg == (uint8_t*)PTE_ZERO || mem_ptr2pi(dpg)->refcount > 1){
-    pageinfo *npi = mem_alloc(); assert(npi);
-    mem_incref(npi);
-    uint8_t *npg = mem_pi2ptr(npi);
-    memmove(npg, dpg, PAGESIZE);
-    if(dpg != (uint8_t*)PTE_ZERO)
-      mem_decref(mem_ptr2pi(dpg), mem_free);
-      dpg = npg;
-      *dpte = (uint32_t)npg | SYS_RW | PTE_A | PTE_D | PTE_W | PTE_U | PTE_P;
-      }
+// Hand out the next piece of the shared merge, if there's one left.
+static pmap_mergework *
+pmap_mergeclaim(void)
+{
+	pmap_mergework *w = NULL;
+	spinlock_acquire(&pmap_mergejob.lock);
+	if (pmap_mergejob.next < pmap_mergejob.nwork && !pmap_mergejob.failed)
+		w = &pmap_mergejob.work[pmap_mergejob.next++];
+	spinlock_release(&pmap_mergejob.lock);
+	return w;
+}
 
-      int i;
-      for(i = 0; i < PAGESIZE; i++){
-      if(spg[i] == rpg[i])
-      continue;
-      if(dpg[i] == rpg[i]){
-      dpg[i] = spg[i];
-      continue;
-      }
+static void
+pmap_mergedone(pmap_mergework *w)
+{
+	spinlock_acquire(&pmap_mergejob.lock);
+	pmap_mergejob.ndone++;
+	if (!w->ok)
+		pmap_mergejob.failed = 1;
+	spinlock_release(&pmap_mergejob.lock);
+}
 
-      cprintf("pmap_mergepage: conflict ad dva %x\n", dva);
-      mem_decref(mem_phys2pi(PGADDR(*dpte)), mem_free);
-      *dpte = PTE_ZERO;
-      return;
-      }
+//
+// Called from the idle loop: help with a merge another CPU is doing.
+// Each piece covers its own whole page tables in the source and
+// destination, so the pieces can be merged in any order, at once.
+// The destination is only loaded on the merging CPU, which has
+// already invalidated the range, so we need not flush any TLB here.
+// Returns false if there was nothing to do.
+//
+bool
+pmap_mergeidle(void)
+{
+	if (pmap_mergejob.nwork == 0)	// nothing going: don't take the lock
+		return 0;
+	pmap_mergework *w = pmap_mergeclaim();
+	if (w == NULL)
+		return 0;
+	pmap_mergerange(w);
+	pmap_mergedone(w);
+	cpu_cur()->mergepieces++;
+	return 1;
 }
 
-// 
+//
 // Merge differences between a reference snapshot represented by rpdir
 // and a source address space spdir into a destination address space dpdir.
+// Where the source and destination line up on 4MB page tables,
+// a large merge is cut into pieces of whole page tables,
+// which idle CPUs help with (see pmap_mergeidle()).
+// The pieces are cut the same way however many CPUs help,
+// and each one's result depends only on its own range,
+// so the merged memory and the statistics are the same too.
+// Fills in *ms if it's not NULL, else prints any conflicts found.
 //
 int
 pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
-		pde_t *dpdir, uint32_t dva, size_t size)
+		pde_t *dpdir, uint32_t dva, size_t size, mergestats *ms)
 {
-	assert(PTOFF(sva) == 0);	// must be 4MB-aligned
-	assert(PTOFF(dva) == 0);
-	assert(PTOFF(size) == 0);
+	assert(PGOFF(sva) == 0);	// must be page-aligned
+	assert(PGOFF(dva) == 0);
+	assert(PGOFF(size) == 0);
 	assert(sva >= VM_USERLO && sva < VM_USERHI);
 	assert(dva >= VM_USERLO && dva < VM_USERHI);
 	assert(size <= VM_USERHI - sva);
 	assert(size <= VM_USERHI - dva);
 
-  pde_t *rpde = &rpdir[PDX(sva)];
-  pde_t *spde = &spdir[PDX(sva)];
-  pde_t *dpde = &dpdir[PDX(dva)];
-  uint32_t svahi = sva + size;
+	pmap_inval(spdir, sva, size);
+	pmap_inval(dpdir, dva, size);
 
-  for (; sva < svahi; rpde++, spde++, dpde++){
-  if(*spde == *rpde){
-  sva += PTSIZE, dva += PTSIZE;
-  continue;
-  }
+	// Cut the range at multiples of 'span', which is a multiple of PTSIZE
+	// chosen so that there are at most PMAP_MERGEWORK pieces.
+	uint32_t span = MAX(PMAP_MERGESPAN,
+			ROUNDUP(size / (PMAP_MERGEWORK-1), PTSIZE));
+	uint32_t svahi = sva + size;
+	bool share = PTOFF(sva) == PTOFF(dva) && svahi - sva > span
+			&& cpu_boot.next != NULL
+			&& spinlock_try(&pmap_mergebusy);
+	pmap_mergework one, *work = share ? pmap_mergejob.work : &one;
+	int i, nwork = 0;
+	while (sva < svahi) {
+		uint32_t n = share ? MIN(svahi - sva, span - sva % span)
+				: svahi - sva;
+		pmap_mergework *w = &work[nwork++];
+		w->rpdir = rpdir, w->spdir = spdir, w->dpdir = dpdir;
+		w->sva = sva, w->dva = dva, w->size = n;
+		sva += n, dva += n;
+	}
 
-  if(*dpde == *rpde){
-    if(!pmap_copy(spdir, sva, dpdir, dva, PTSIZE))
-      return 0;
-      sva += PTSIZE, dva += PTSIZE;
-      continue;
-      }
-
-      pte_t *rpte = mem_ptr(PGADDR(*rpde));
-      pte_t *spte = mem_ptr(PGADDR(*spde));
-      pte_t *dpte = pmap_walk(dpdir, dva, 1);
-      if (dpte == NULL)
-        return 0;
-
-        pte_t *erpte = &rpte[NPTENTRIES];
-        for(; rpte <erpte; rpte++, spte++, dpte++, sva += PAGESIZE, dva += PAGESIZE){
-        
-        if (*spte == *rpte)
-        continue;
-        if (*dpte == *rpte)
-        { if(PGADDR(*dpte) != PTE_ZERO)
-          mem_decref(mem_phys2pi(PGADDR(*dpte)),mem_free);
-          *spte &= ~PTE_W;
-          *dpte = *spte;
-          mem_incref(mem_phys2pi(PGADDR(*spte)));
-          continue;
-          }
-                    
-
-          pmap_mergepage(rpte, spte, dpte, dva);
-         }
-         }
-          
-return 1;
+	if (!share)
+		pmap_mergerange(&one);
+	else {
+		assert(nwork <= PMAP_MERGEWORK);
+		spinlock_acquire(&pmap_mergejob.lock);
+		pmap_mergejob.next = pmap_mergejob.ndone = 0;
+		pmap_mergejob.failed = 0;
+		pmap_mergejob.nwork = nwork;
+		spinlock_release(&pmap_mergejob.lock);
+		cpu_wake(nwork - 1);	// get halted CPUs to help
+
+		// Merge pieces ourselves until none are left to hand out,
+		// then wait for the ones idle CPUs are still working on.
+		pmap_mergework *w;
+		while ((w = pmap_mergeclaim()) != NULL) {
+			pmap_mergerange(w);
+			pmap_mergedone(w);
+		}
+		spinlock_acquire(&pmap_mergejob.lock);
+		while (pmap_mergejob.ndone < pmap_mergejob.next) {
+			spinlock_release(&pmap_mergejob.lock);
+			pause();
+			spinlock_acquire(&pmap_mergejob.lock);
+		}
+		pmap_mergejob.nwork = 0;
+		spinlock_release(&pmap_mergejob.lock);
+	}
+
+	// Pieces after one that failed may not have been merged at all;
+	// the caller reports the failure, as when a lone merge stops part way.
+	// Add up the pieces' statistics in address order.
+	bool ok = 1;
+	mergestats st;
+	memset(&st, 0, sizeof(st));
+	for (i = 0; i < nwork && ok; i++) {
+		mergestats *wst = &work[i].st;
+		st.scanned += wst->scanned;
+		st.copied += wst->copied;
+		st.diffed += wst->diffed;
+		int j;
+		for (j = 0; j < MIN(wst->nconflict, MSTATS_CONFLICTS)
+				&& st.nconflict + j < MSTATS_CONFLICTS; j++)
+			st.conflicts[st.nconflict + j] = wst->conflicts[j];
+		st.nconflict += wst->nconflict;
+		ok = work[i].ok;
+	}
+	if (share)
+		spinlock_release(&pmap_mergebusy);
+	if (ms != NULL)
+		*ms = st;
+	else if (st.nconflict > 0)
+		cprintf("pmap_merge: %d conflicting pages, first at dva %x\n",
+			st.nconflict, st.conflicts[0]);
+	return ok;
+}
+
+//
+// Free the page tables in 'pdir' that map nothing at all,
+// i.e., with no live entries left, unless they are shared.
+// Only for pdirs not loaded on any CPU, so no TLB flush is needed.
+// Returns the number of page tables freed.
+//
+int
+pmap_trim(pde_t *pdir)
+{
+	int n = 0;
+	uint32_t va;
+	for (va = VM_USERLO; va < VM_USERHI; va += PTSIZE) {
+		pde_t *pde = &pdir[PDX(va)];
+		if (!(*pde & PTE_P) || (*pde & PTE_PS))
+			continue;
+		pageinfo *pi = mem_phys2pi(PGADDR(*pde));
+		if (pi->refcount != 1 || pi->ptlive != 0)
+			continue;
+		*pde = PTE_ZERO;
+		mem_decref(pi, pmap_freeptab);
+		n++;
+	}
+	return n;
 }
 
 //
@@ -563,15 +1367,28 @@ pmap_setperm(pde_t *pdir, uint32_t va, uint32_t size, int perm)
     continue;
     }
 
+    // A superpage keeps its size if the whole 4MB stays readable;
+    // it's private, so it can be writable right away.
+    if ((*pde & PTE_PS) && PTX(va) == 0 && vahi-va >= PTSIZE
+        && (perm & SYS_READ)) {
+      *pde = (*pde & pteand) | pteor | ((perm & SYS_WRITE) ? PTE_W : 0);
+      va += PTSIZE;
+      continue;
+    }
+
     pte_t *pte = pmap_walk(pdir, va, 1);
     if (pte == NULL)
       return 0;
 
     do {
-    *pte = (*pte & pteand) | pteor;
+    if (*pte & PTE_SWAP)	// stays out on disk until touched
+      pmap_setpte(pte, ((*pte & pteand) | pteor) & ~(PTE_P | PTE_W));
+    else
+      pmap_setpte(pte, (*pte & pteand) | pteor);
     pte++;
     va += PAGESIZE;
     } while(va < vahi && PTX(va) !=0);
+    pmap_ptabdrop(pde);
     }
     return 1;
 
@@ -592,6 +1409,8 @@ va2pa(pde_t *pdir, uintptr_t va)
 	pdir = &pdir[PDX(va)];
 	if (!(*pdir & PTE_P))
 		return ~0;
+	if (*pdir & PTE_PS)
+		return PGADDR(*pdir) + (PTOFF(va) & ~PGOFF(~0));
 	pte_t *ptab = mem_ptr(PGADDR(*pdir));
 	if (!(ptab[PTX(va)] & PTE_P))
 		return ~0;
@@ -602,10 +1421,9 @@ va2pa(pde_t *pdir, uintptr_t va)
 void
 pmap_check(void)
 {
-	extern pageinfo *mem_freelist;
 
 	pageinfo *pi, *pi0, *pi1, *pi2, *pi3;
-	pageinfo *fl;
+	mem_stash st;
 	pte_t *ptep, *ptep1;
 	int i;
 
@@ -621,8 +1439,7 @@ pmap_check(void)
 	assert(pi2 && pi2 != pi1 && pi2 != pi0);
 
 	// temporarily steal the rest of the free pages
-	fl = mem_freelist;
-	mem_freelist = NULL;
+	mem_stash_free(&st);
 
 	// should be no free memory
 	assert(mem_alloc() == NULL);
@@ -695,21 +1512,27 @@ pmap_check(void)
 	assert(pi2->refcount == 0);
 	assert(mem_alloc() == NULL);	// still should have no pages free
 
-	// unmapping pi1 at VM_USERLO+PAGESIZE should free it
+	// unmapping pi1 at VM_USERLO+PAGESIZE should free it,
+	// and the page table too, now that it maps nothing
 	pmap_remove(pmap_bootpdir, VM_USERLO+PAGESIZE, PAGESIZE);
 	assert(va2pa(pmap_bootpdir, VM_USERLO+0) == ~0);
 	assert(va2pa(pmap_bootpdir, VM_USERLO+PAGESIZE) == ~0);
 	assert(pi1->refcount == 0);
 	assert(pi2->refcount == 0);
+	assert(pmap_bootpdir[PDX(VM_USERLO)] == PTE_ZERO);
+	assert(pi0->refcount == 0);
 
-	// so it should be returned by page_alloc
-	assert(mem_alloc() == pi1);
+	// so they should be returned by page_alloc
+	pi = mem_alloc();
+	assert(pi == pi0 || pi == pi1);
+	assert(mem_alloc() == (pi == pi0 ? pi1 : pi0));
 
 	// should once again have no free memory
 	assert(mem_alloc() == NULL);
 
 	// should be able to pmap_insert to change a page
 	// and see the new data immediately.
+	mem_free(pi0);		// for the page table
 	memset(mem_pi2ptr(pi1), 1, PAGESIZE);
 	memset(mem_pi2ptr(pi2), 2, PAGESIZE);
 	pmap_insert(pmap_bootpdir, pi1, VM_USERLO, 0);
@@ -722,14 +1545,16 @@ pmap_check(void)
 	assert(mem_alloc() == pi1);
 	pmap_remove(pmap_bootpdir, VM_USERLO, PAGESIZE);
 	assert(pi2->refcount == 0);
-	assert(mem_alloc() == pi2);
+	assert(pmap_bootpdir[PDX(VM_USERLO)] == PTE_ZERO);
+	assert(pi0->refcount == 0);
+	pi = mem_alloc();
+	assert(pi == pi0 || pi == pi2);
+	assert(mem_alloc() == (pi == pi0 ? pi2 : pi0));
 
-	// now use a pmap_remove on a large region to take pi0 back
+	// a pmap_remove on a large region with nothing in it does nothing
 	pmap_remove(pmap_bootpdir, VM_USERLO, VM_USERHI-VM_USERLO);
 	assert(pmap_bootpdir[PDX(VM_USERLO)] == PTE_ZERO);
-	assert(pi0->refcount == 0);
-	assert(mem_alloc() == pi0);
-	assert(mem_freelist == NULL);
+	assert(mem_nfree == 0);
 
 	// test pmap_remove with large, non-ptable-aligned regions
 	mem_free(pi1);
@@ -738,14 +1563,14 @@ pmap_check(void)
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PAGESIZE, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE-PAGESIZE, 0));
 	assert(PGADDR(pmap_bootpdir[PDX(VM_USERLO)]) == mem_pi2phys(pi1));
-	assert(mem_freelist == NULL);
+	assert(mem_nfree == 0);
 	mem_free(pi2);
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE+PAGESIZE, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*2-PAGESIZE, 0));
 	assert(PGADDR(pmap_bootpdir[PDX(VM_USERLO+PTSIZE)])
 		== mem_pi2phys(pi2));
-	assert(mem_freelist == NULL);
+	assert(mem_nfree == 0);
 	mem_free(pi3);
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*2, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*2+PAGESIZE, 0));
@@ -753,7 +1578,7 @@ pmap_check(void)
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*3-PAGESIZE, 0));
 	assert(PGADDR(pmap_bootpdir[PDX(VM_USERLO+PTSIZE*2)])
 		== mem_pi2phys(pi3));
-	assert(mem_freelist == NULL);
+	assert(mem_nfree == 0);
 	assert(pi0->refcount == 10);
 	assert(pi1->refcount == 1);
 	assert(pi2->refcount == 1);
@@ -761,17 +1586,17 @@ pmap_check(void)
 	pmap_remove(pmap_bootpdir, va+PAGESIZE, PTSIZE*3-PAGESIZE*2);
 	assert(pi0->refcount == 2);
 	assert(pi2->refcount == 0); assert(mem_alloc() == pi2);
-	assert(mem_freelist == NULL);
+	assert(mem_nfree == 0);
 	pmap_remove(pmap_bootpdir, va, PTSIZE*3-PAGESIZE);
 	assert(pi0->refcount == 1);
 	assert(pi1->refcount == 0); assert(mem_alloc() == pi1);
-	assert(mem_freelist == NULL);
+	assert(mem_nfree == 0);
 	pmap_remove(pmap_bootpdir, va+PTSIZE*3-PAGESIZE, PAGESIZE);
-	assert(pi0->refcount == 0);	// pi3 might or might not also be freed
+	assert(pi0->refcount == 0);
+	assert(pi3->refcount == 0);	// the last entry went with the table
 	pmap_remove(pmap_bootpdir, va+PAGESIZE, PTSIZE*3);
-	assert(pi3->refcount == 0);
 	mem_alloc(); mem_alloc();	// collect pi0 and pi3
-	assert(mem_freelist == NULL);
+	assert(mem_nfree == 0);
 
 	// check pointer arithmetic in pmap_walk
 	mem_free(pi0);
@@ -789,11 +1614,45 @@ pmap_check(void)
 	ptep = mem_pi2ptr(pi0);
 	for(i=0; i<NPTENTRIES; i++)
 		assert(ptep[i] == PTE_ZERO);
-	pmap_bootpdir[PDX(VM_USERHI-PAGESIZE)] = PTE_ZERO;
-	pi0->refcount = 0;
+
+	// check that live entries are counted, nominal permissions included,
+	// and that a page table goes away with its last live entry
+	assert(pi0->ptlive == 0);
+	assert(pmap_setperm(pmap_bootpdir, VM_USERHI-PAGESIZE, PAGESIZE,
+				SYS_READ));
+	assert(pi0->ptlive == 1 && PGADDR(ptep[NPTENTRIES-1]) == PTE_ZERO);
+	assert(pmap_trim(pmap_bootpdir) == 0);
+	assert(pmap_setperm(pmap_bootpdir, VM_USERHI-PAGESIZE, PAGESIZE, 0));
+	assert(pmap_bootpdir[PDX(VM_USERHI-PAGESIZE)] == PTE_ZERO);
+	assert(pi0->refcount == 0 && mem_nfree == 1);
+
+	// check that pmap_trim frees page tables left with nothing in them
+	assert(pmap_walk(pmap_bootpdir, VM_USERHI-PAGESIZE, 1) != NULL);
+	assert(pi0->refcount == 1 && mem_nfree == 0);
+	assert(pmap_trim(pmap_bootpdir) == 1);
+	assert(pmap_bootpdir[PDX(VM_USERHI-PAGESIZE)] == PTE_ZERO);
+	assert(pi0->refcount == 0 && mem_nfree == 1);
+	assert(mem_alloc() == pi0);
+
+	// check that invalidations are batched, and only for the loaded pdir
+	cpu *c = cpu_cur();
+	uint32_t flushes = c->tlbflushes, invlpgs = c->tlbinvlpgs;
+	pmap_invalbegin();
+	pmap_inval(pmap_bootpdir, VM_USERLO+PAGESIZE, PAGESIZE*2);
+	pmap_inval(mem_pi2ptr(pi1), VM_USERLO, PTSIZE);	// not loaded
+	assert(c->ninval == 2 && !c->invall);
+	pmap_invalflush();
+	assert(c->tlbinvlpgs == invlpgs + 2 && c->tlbflushes == flushes);
+	pmap_invalbegin();
+	pmap_inval(pmap_bootpdir, VM_USERLO, PAGESIZE);
+	pmap_inval(pmap_bootpdir, VM_USERLO, PAGESIZE*PMAP_INVALMAX);
+	assert(c->invall);
+	pmap_invalflush();
+	assert(c->tlbinvlpgs == invlpgs + 2 && c->tlbflushes == flushes + 1);
+	assert(!c->invbatch && c->ninval == 0);
 
 	// give free list back
-	mem_freelist = fl;
+	mem_unstash_free(&st);
 
 	// free the pages we filched
 	mem_free(pi0);
@@ -801,6 +1660,214 @@ pmap_check(void)
 	mem_free(pi2);
 	mem_free(pi3);
 
+	// check that a full, private 4MB region becomes a superpage in place
+	// only once its pages lie in order in one aligned block...
+	uint32_t sva = VM_USERLO, dva = VM_USERLO + PTSIZE;
+	pageinfo *blk = mem_alloc_order(MEM_MAXORDER); assert(blk);
+	for (i = 0; i < NPTENTRIES; i++) {
+		*(int*)mem_pi2ptr(&blk[i]) = i;
+		assert(pmap_insert(pmap_bootpdir, &blk[i ^ (i < 2)],
+				sva + i*PAGESIZE, SYS_RW | PTE_U | PTE_W));
+	}
+	pde_t *pde = &pmap_bootpdir[PDX(sva)];
+	pmap_promote(pmap_bootpdir, sva);	// first two pages swapped
+	assert(!(*pde & PTE_PS));
+	mem_incref(&blk[1]);	// don't free it while swapping back
+	assert(pmap_insert(pmap_bootpdir, &blk[0], sva, SYS_RW | PTE_U | PTE_W));
+	assert(pmap_insert(pmap_bootpdir, &blk[1], sva + PAGESIZE,
+			SYS_RW | PTE_U | PTE_W));
+	mem_decref(&blk[1], mem_free);
+	pmap_promote(pmap_bootpdir, sva);
+	assert((*pde & (PTE_PS | PTE_W)) == (PTE_PS | PTE_W));
+	pi = mem_phys2pi(PGADDR(*pde));
+	assert(pi == blk && pi[0].refcount == 1 && pi[1].refcount == 0);
+	for (i = 0; i < NPTENTRIES; i++)
+		assert(((int*)mem_pi2ptr(pi))[i*PAGESIZE/4] == i);
+	assert(va2pa(pmap_bootpdir, sva + 5*PAGESIZE) == mem_pi2phys(pi+5));
+
+	// ...that keeps its size through permission changes on all of it...
+	assert(pmap_setperm(pmap_bootpdir, sva, PTSIZE, SYS_READ));
+	assert((*pde & (PTE_PS | PTE_W | SYS_RW)) == (PTE_PS | SYS_READ));
+	assert(pmap_setperm(pmap_bootpdir, sva, PTSIZE, SYS_RW));
+	assert((*pde & (PTE_PS | PTE_W | SYS_RW)) == (PTE_PS | PTE_W | SYS_RW));
+
+	// ...and is split again by copy-on-write, into its own pages
+	assert(pmap_copy(pmap_bootpdir, sva, pmap_bootpdir, dva, PTSIZE));
+	assert(!(*pde & PTE_PS) && pmap_bootpdir[PDX(dva)] == (*pde & ~PTE_W));
+	assert(mem_phys2pi(PGADDR(*pde))->ptlive == NPTENTRIES);
+	for (i = 0; i < NPTENTRIES; i++) {
+		assert(va2pa(pmap_bootpdir, dva + i*PAGESIZE)
+			== mem_pi2phys(pi+i));
+		assert(pi[i].refcount == 1);
+	}
+	pmap_remove(pmap_bootpdir, sva, PTSIZE*2);
+	for (i = 0; i < NPTENTRIES; i++)
+		assert(pi[i].refcount == 0);
+
+	// check that a merge cut into pieces merges each piece as a whole:
+	// pages new in the source go across, a conflicting one is dropped.
+	pde_t *rpdir = pmap_newpdir(), *spdir = pmap_newpdir();
+	pde_t *dpdir = pmap_newpdir();
+	assert(rpdir && spdir && dpdir);
+	uint32_t mva[3] = { VM_USERLO, VM_USERLO + PMAP_MERGESPAN + PAGESIZE,
+			VM_USERLO + PMAP_MERGESPAN*3 - PAGESIZE };
+	for (i = 0; i < 3; i++) {
+		pi = mem_alloc(); assert(pi);
+		memset(mem_pi2ptr(pi), 1, PAGESIZE);
+		assert(pmap_insert(spdir, pi, mva[i], SYS_RW | PTE_U));
+	}
+	pi = mem_alloc(); assert(pi);
+	memset(mem_pi2ptr(pi), 2, PAGESIZE);
+	assert(pmap_insert(dpdir, pi, mva[1], SYS_RW | PTE_U));
+	mergestats ms;
+	assert(pmap_merge(rpdir, spdir, VM_USERLO, dpdir, VM_USERLO,
+				PMAP_MERGESPAN*3, &ms));
+	assert(ms.scanned == NPTENTRIES && ms.copied == 2);
+	assert(ms.diffed == PAGESIZE && ms.nconflict == 1);
+	assert(ms.conflicts[0] == mva[1]);
+	assert(va2pa(dpdir, mva[0]) == va2pa(spdir, mva[0]));
+	assert(va2pa(dpdir, mva[1]) == ~0);
+	assert(va2pa(dpdir, mva[2]) == va2pa(spdir, mva[2]));
+	assert(pi->refcount == 0);
+	mem_decref(mem_ptr2pi(rpdir), pmap_freepdir);
+	mem_decref(mem_ptr2pi(spdir), pmap_freepdir);
+	mem_decref(mem_ptr2pi(dpdir), pmap_freepdir);
+
+	// check that a large pmap_remove() unmaps page tables right away,
+	// but leaves freeing them and their pages to idle CPUs
+	pi = mem_alloc(); assert(pi);
+	assert(pmap_insert(pmap_bootpdir, pi, VM_USERLO, SYS_READ | PTE_U));
+	pageinfo *ptabpi = mem_phys2pi(PGADDR(pmap_bootpdir[PDX(VM_USERLO)]));
+	pmap_remove(pmap_bootpdir, VM_USERLO, PMAP_DEFERMIN);
+	assert(pmap_bootpdir[PDX(VM_USERLO)] == PTE_ZERO);
+	assert(pi->refcount == 1 && ptabpi->refcount == 1);
+	while (pmap_deferidle())
+		;
+	assert(pi->refcount == 0 && ptabpi->refcount == 0);
+
 	cprintf("pmap_check() succeeded!\n");
 }
 
+
+// Print each CPU's TLB invalidation, superpage and idle work counts,
+// and how many pages processes' write faults resolved.
+void
+pmap_stats(void)
+{
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		cprintf("cpu%d: %d TLB flushes, %d pages invalidated, "
+			"%d superpages made, %d split, "
+			"%d merge pieces helped with, "
+			"%d page tables torn down\n",
+			c->id, c->tlbflushes, c->tlbinvlpgs,
+			c->superpages, c->supersplits, c->mergepieces,
+			c->teardowns);
+
+	uint32_t faults = 0, pages = 0;
+	proc *p;
+	for (p = proc_all; p != NULL; p = p->allnext)
+		faults += p->faults, pages += p->faultpages;
+	cprintf("pmap: %d write faults made %d pages writable\n",
+		faults, pages);
+}
+
+// Time 'iters' three-way merges of page 'spg' into page 'dpg' with 'diff',
+// restoring dpg from rpg before each, and return the throughput in MB/s.
+static uint32_t
+pmap_mergetime(bool (*diff)(const uint8_t *, const uint8_t *, uint8_t *),
+		const uint8_t *rpg, const uint8_t *spg, uint8_t *dpg, int iters)
+{
+	uint64_t cycles = 0;
+	int i;
+	for (i = 0; i < iters; i++) {
+		memmove(dpg, rpg, PAGESIZE);
+		uint64_t start = rdtsc();
+		diff(rpg, spg, dpg);
+		cycles += rdtsc() - start;
+	}
+	if (cycles == 0)
+		cycles = 1;
+	return (uint64_t)iters * PAGESIZE * pit_tscfreq() / cycles / 1000000;
+}
+
+//
+// Check pmap_mergediff() against the byte-at-a-time merge,
+// and report how fast each merges a page with few and many changes.
+//
+void
+pmap_mergecheck(void)
+{
+	pageinfo *pi[4];
+	int i, j;
+	for (i = 0; i < 4; i++) {
+		pi[i] = mem_alloc(); assert(pi[i] != NULL);
+	}
+	uint8_t *rpg = mem_pi2ptr(pi[0]), *spg = mem_pi2ptr(pi[1]);
+	uint8_t *dpg = mem_pi2ptr(pi[2]), *bpg = mem_pi2ptr(pi[3]);
+
+	// Scattered changes in both pages, at every offset within a block,
+	// including ones that make the source byte equal to the reference.
+	for (i = 0; i < PAGESIZE; i++)
+		rpg[i] = i * 7;
+	memmove(spg, rpg, PAGESIZE);
+	memmove(dpg, rpg, PAGESIZE);
+	for (i = 0; i < PAGESIZE; i += 61)
+		spg[i] ^= 0x5a;
+	for (i = 30; i < PAGESIZE; i += 67)
+		if (spg[i] == rpg[i])
+			dpg[i] ^= 0xa5;
+	memmove(bpg, dpg, PAGESIZE);
+	assert(pmap_mergediff(rpg, spg, dpg));
+	assert(pmap_mergediff_bytes(rpg, spg, bpg));
+	assert(memcmp(dpg, bpg, PAGESIZE) == 0);
+	for (i = 0; i < PAGESIZE; i += 61)
+		assert(dpg[i] == spg[i]);
+
+	// A byte changed on both sides is a conflict, wherever it is;
+	// a byte changed the same way on both sides is too.
+	for (j = 0; j < 64; j += 13) {
+		memmove(dpg, rpg, PAGESIZE);
+		dpg[PAGESIZE-64+j] = spg[PAGESIZE-64+j] = rpg[PAGESIZE-64+j] + 1;
+		assert(!pmap_mergediff(rpg, spg, dpg));
+		memmove(spg + PAGESIZE-64, rpg + PAGESIZE-64, 64);
+	}
+
+	// Throughput for a typical child's page, with one 64-byte block
+	// changed, and for a page changed all over.
+	memmove(spg, rpg, PAGESIZE);
+	spg[PAGESIZE/2] ^= 1;
+	uint32_t bsparse = pmap_mergetime(pmap_mergediff_bytes,
+						rpg, spg, dpg, 256);
+	uint32_t xsparse = pmap_mergetime(pmap_mergediff, rpg, spg, dpg, 256);
+	for (i = 0; i < PAGESIZE; i += 64)
+		spg[i] ^= 1;
+	uint32_t bdense = pmap_mergetime(pmap_mergediff_bytes,
+						rpg, spg, dpg, 256);
+	uint32_t xdense = pmap_mergetime(pmap_mergediff, rpg, spg, dpg, 256);
+	cprintf("pmap_mergecheck: bytewise %d.%02d/%d.%02d GB/s, "
+		"SSE2 %d.%02d/%d.%02d GB/s (sparse/dense)\n",
+		bsparse/1000, bsparse%1000/10, bdense/1000, bdense%1000/10,
+		xsparse/1000, xsparse%1000/10, xdense/1000, xdense%1000/10);
+
+	// A zero destination page is merged into like any other, not skipped:
+	// it may have been zeroed by dedup rather than by the parent.
+	memset(rpg, 0, PAGESIZE);
+	memset(spg, 0, PAGESIZE);
+	spg[100] = 1;
+	pte_t *ptes = (pte_t*) bpg;	// stands in for a page table
+	ptes[0] = mem_pi2phys(pi[0]) | SYS_RW | PTE_U | PTE_P;
+	ptes[1] = mem_pi2phys(pi[1]) | SYS_RW | PTE_U | PTE_P;
+	ptes[2] = PTE_ZERO | SYS_RW | PTE_U | PTE_P;
+	pmap_mergework w;
+	memset(&w, 0, sizeof(w));
+	assert(pmap_mergepte(&ptes[0], &ptes[1], &ptes[2], VM_USERLO, &w));
+	assert(PGADDR(ptes[2]) != PTE_ZERO && w.st.nconflict == 0);
+	dpg = pmap_kmap(PGADDR(ptes[2]), PMAP_KMAP_DST);
+	assert(dpg[100] == 1 && dpg[0] == 0 && dpg[PAGESIZE-1] == 0);
+	pmap_pteunref(ptes[2]);
+
+	for (i = 0; i < 4; i++)
+		mem_free(pi[i]);
+	cprintf("pmap_mergecheck() succeeded!\n");
+}
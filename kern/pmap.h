@@ -17,6 +17,7 @@
 #include <inc/assert.h>
 #include <inc/mmu.h>
 #include <inc/vm.h>
+#include <inc/syscall.h>
 
 #include <kern/mem.h>
 
@@ -43,6 +44,36 @@ extern uint8_t pmap_zero[PAGESIZE];
 // instead the page fault handler creates copies of the zero page on demand.
 #define PTE_ZERO	((uint32_t)pmap_zero)
 
+// The 4MB just below VM_USERLO is mapped by one page table shared by all
+// page directories, which gives each CPU a few slots for temporary mappings
+// of physical pages at or above MEM_HIGH.  A slot stays valid only until
+// the same CPU maps something else into it.
+#define PMAP_KMAPLO	MEM_HIGH
+#define PMAP_KMAPSLOTS	4	// Slots per CPU
+#define PMAP_KMAP_SRC	0	// Page being copied or merged from
+#define PMAP_KMAP_DST	1	// Page being copied or merged into
+#define PMAP_KMAP_REF	2	// Reference snapshot page in a merge
+#define PMAP_KMAP_TMP	3	// Scratch: page being cleared, etc.
+
+// Invalidating more than this many pages of the current address space
+// at once reloads CR3 instead of doing an invlpg per page.
+#define PMAP_INVALMAX	16
+
+// A merge of more than PMAP_MERGESPAN bytes is cut into pieces
+// for idle CPUs to help with: no more than PMAP_MERGEWORK of them,
+// and each at least PMAP_MERGESPAN bytes (a multiple of PTSIZE).
+#define PMAP_MERGESPAN	(PTSIZE*4)
+#define PMAP_MERGEWORK	64
+
+// pmap_remove() of at least PMAP_DEFERMIN bytes leaves freeing the
+// private page tables it unmaps, and their pages, to idle CPUs,
+// with up to PMAP_DEFERMAX page tables waiting at a time.
+#define PMAP_DEFERMIN	(PTSIZE*16)
+#define PMAP_DEFERMAX	256
+
+// Max pages made writable by one write fault, see pmap_pagefault().
+#define PMAP_FAULTMAX	16
+
 
 void pmap_init(void);
 pte_t *pmap_newpdir(void);
@@ -52,13 +83,25 @@ pte_t *pmap_walk(pde_t *pdir, uint32_t uva, bool writing);
 pte_t *pmap_insert(pde_t *pdir, pageinfo *pi, uint32_t uva, int perm);
 void pmap_remove(pde_t *pdir, uint32_t uva, size_t size);
 void pmap_inval(pde_t *pdir, uint32_t uva, size_t size);
+void pmap_invalbegin(void);
+void pmap_invalflush(void);
+void pmap_invalcancel(void);
 int pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 		size_t size);
 int pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
-		pde_t *dpdir, uint32_t dva, size_t size);
+		pde_t *dpdir, uint32_t dva, size_t size, mergestats *ms);
+bool pmap_mergeidle(void);
+bool pmap_deferidle(void);
 int pmap_setperm(pde_t *pdir, uint32_t va, uint32_t size, int perm);
+int pmap_trim(pde_t *pdir);
 void pmap_pagefault(trapframe *tf);
 void pmap_check(void);
+void pmap_mergecheck(void);
+void pmap_stats(void);
+
+// Return a kernel pointer to the physical page 'pa', using the given
+// per-CPU kmap slot if the page is not directly mapped.
+void *pmap_kmap(uint32_t pa, int slot);
 
 
 #endif /* !PIOS_KERN_PMAP_H */
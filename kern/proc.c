@@ -16,6 +16,10 @@
 #include <kern/proc.h>
 #include <kern/init.h>
 #include <kern/file.h>
+#include <kern/slab.h>
+#include <kern/dedup.h>
+
+#include <dev/pit.h>
 
 
 
@@ -23,19 +27,73 @@ proc proc_null;		// null process - just leave it initialized to 0
 
 proc *proc_root;	// root process, once it's created in init()
 
-static spinlock readylock;
-static proc *readyhead;
-static proc **readytail;
+proc *proc_all;		// all processes, linked through allnext
+static spinlock proc_alllock;	// serializes additions to proc_all
+
+static slab_cache proc_cache;	// Where proc structs come from
+
+
+// Construct a proc in the state every free proc in proc_cache is kept in:
+// cleared, with its lock initialized and its user segment registers set.
+static void
+proc_ctor(void *obj)
+{
+	proc *cp = obj;
+	memset(cp, 0, sizeof(proc));
+	spinlock_init(&cp->lock);
+
+	// Integer register state
+	cp->sv.tf.ds = CPU_GDT_UDATA | 3;
+	cp->sv.tf.es = CPU_GDT_UDATA | 3;
+	cp->sv.tf.cs = CPU_GDT_UCODE | 3;
+	cp->sv.tf.ss = CPU_GDT_UDATA | 3;
+}
+
+//
+// Memory reclaimer: free what the current process's stopped children
+// can do without.  Only the process running on this CPU controls them,
+// so nobody else is touching their page directories meanwhile -
+// except the child of a PUT or GET we may be in the middle of.
+// A snapshot that has already been merged is usually dead weight;
+// if the parent does merge from it again, do_get() reports T_NOMEM.
+//
+static void
+proc_reclaim(size_t target)
+{
+	proc *p = proc_cur();
+	if (p == NULL || p->state != PROC_RUN || p->runcpu != cpu_cur())
+		return;		// idle, so there's no current process
+
+	int i;
+	for (i = 0; i < PROC_CHILDREN && mem_nfree < target; i++) {
+		proc *cp = p->child[i];
+		if (cp == NULL || cp == p->opchild || cp->state != PROC_STOP)
+			continue;
+		if (cp->snapmerged) {
+			pmap_remove(cp->rpdir, VM_USERLO, VM_USERHI-VM_USERLO);
+			cp->snapmerged = 0;
+			cp->snaplost = 1;
+		}
+		pmap_trim(cp->pdir);
+		pmap_trim(cp->rpdir);
+	}
+}
 
 void
 proc_init(void)
 {
+  // Each CPU sets up its own ready queue.
+  cpu *c = cpu_cur();
+  spinlock_init(&c->readylock);
+  c->readytail = &c->readyhead;
+
   if (!cpu_onboot())
  	return;
 
   // your module initialization code here
-  spinlock_init(&readylock);
-  readytail = &readyhead;
+  slab_init(&proc_cache, "proc", sizeof(proc), 16, proc_ctor);
+  spinlock_init(&proc_alllock);
+  mem_reclaim_register(proc_reclaim);
 }
 
 // Allocate and initialize a new proc as child 'cn' of parent 'p'.
@@ -43,51 +101,139 @@ proc_init(void)
 proc *
 proc_alloc(proc *p, uint32_t cn)
 {
-	pageinfo *pi = mem_alloc();
-	if (!pi)
+	proc *cp = slab_alloc(&proc_cache);
+	if (!cp)
 		return NULL;
-	mem_incref(pi);
-
-	proc *cp = (proc*)mem_pi2ptr(pi);
-	memset(cp, 0, sizeof(proc));
-	spinlock_init(&cp->lock);
+	assert(cp->state == PROC_STOP && cp->pdir == NULL);
 	cp->parent = p;
-	cp->state = PROC_STOP;
-
-	// Integer register state
-	cp->sv.tf.ds = CPU_GDT_UDATA | 3;
-	cp->sv.tf.es = CPU_GDT_UDATA | 3;
-	cp->sv.tf.cs = CPU_GDT_UCODE | 3;
-	cp->sv.tf.ss = CPU_GDT_UDATA | 3;
 
 	cp->pdir = pmap_newpdir();
 	cp->rpdir = pmap_newpdir();
 	if (!cp->pdir || !cp->rpdir)
 	{
 		if(cp->pdir) 
-			pmap_freepdir(mem_ptr2pi(cp->pdir));
+			mem_decref(mem_ptr2pi(cp->pdir), pmap_freepdir);
+		if(cp->rpdir)
+			mem_decref(mem_ptr2pi(cp->rpdir), pmap_freepdir);
+		proc_ctor(cp);	// back to constructed state
+		slab_free(&proc_cache, cp);
 		return NULL;
 	}
 	
 	if (p)
 		p->child[cn] = cp;
+
+	spinlock_acquire(&proc_alllock);
+	cp->allnext = proc_all;
+	proc_all = cp;
+	spinlock_release(&proc_alllock);
 	
 	return cp;
 }
 
-// Put process p in the ready state and add it to the ready queue.
+// Put process p in the ready state
+// and add it to the tail of the current CPU's ready queue.
 void
 proc_ready(proc *p)
 {
 //	panic("proc_ready not implemented");
-  spinlock_acquire(&readylock);
+  cpu *c = cpu_cur();
+  spinlock_acquire(&c->readylock);
 
   p->state = PROC_READY;
   p->readynext = NULL;
-  *readytail = p;
-  readytail = &p->readynext;
+  p->readycpu = c;
+  *c->readytail = p;
+  c->readytail = &p->readynext;
+  c->nready++;
+
+  spinlock_release(&c->readylock);
+  cpu_wake(1);	// a halted CPU can come and steal it
+}
+
+// Remove the process at the head of CPU c's ready queue and return it
+// locked, or return NULL if the queue is empty.
+static proc *
+proc_readypop(cpu *c)
+{
+  if (c->readyhead == NULL)	// peek without the lock first
+    return NULL;
+
+  spinlock_acquire(&c->readylock);
+  proc *p = c->readyhead;
+  if (p != NULL) {
+    c->readyhead = p->readynext;
+    if (c->readytail == &p->readynext) {
+      assert(c->readyhead == NULL); // ready queue going empty
+      c->readytail = &c->readyhead;
+    }
+    p->readynext = NULL;
+    c->nready--;
+    spinlock_acquire(&p->lock);
+  }
+  spinlock_release(&c->readylock);
+  return p;
+}
 
-  spinlock_release(&readylock);
+// If process p is sitting in a ready queue, remove it and return true
+// with p locked, so the caller can run it straight away.
+// Returns false if p is running, stopped, or already taken by another CPU.
+static bool
+proc_readytake(proc *p)
+{
+  cpu *c = p->readycpu;
+  if (p->state != PROC_READY || c == NULL)	// peek without the lock first
+    return 0;
+
+  spinlock_acquire(&c->readylock);
+  proc **pp = &c->readyhead;
+  while (*pp != NULL && *pp != p)
+    pp = &(*pp)->readynext;
+  bool found = *pp != NULL;
+  if (found) {
+    *pp = p->readynext;
+    if (c->readytail == &p->readynext)
+      c->readytail = pp;
+    p->readynext = NULL;
+    c->nready--;
+    spinlock_acquire(&p->lock);
+  }
+  spinlock_release(&c->readylock);
+  return found;
+}
+
+// Take a ready process from the CPU with the longest ready queue
+// other than ours, or return NULL if the others have nothing ready.
+static proc *
+proc_steal(cpu *c)
+{
+  for (;;) {
+    cpu *vc, *victim = NULL;
+    for (vc = &cpu_boot; vc != NULL; vc = vc->next)
+      if (vc != c && vc->nready > 0
+          && (victim == NULL || vc->nready > victim->nready))
+        victim = vc;
+    if (victim == NULL)
+      return NULL;
+
+    proc *p = proc_readypop(victim);
+    if (p != NULL) {
+      c->steals++;
+      return p;
+    }
+    // Someone got there first: look again.
+  }
+}
+
+// Is there a ready process on any CPU's queue?
+static bool
+proc_anyready(void)
+{
+  cpu *c;
+  for (c = &cpu_boot; c != NULL; c = c->next)
+    if (c->readyhead != NULL)
+      return 1;
+  return 0;
 }
 
 // Save the current process's state before switching to another process.
@@ -108,7 +254,8 @@ proc_save(proc *p, trapframe *tf, int entry)
       p->sv.tf.eip -= 2;  // back up to replay INT instruction
 }
 
-// Go to sleep waiting for a given child process to finish running.
+// Go to sleep waiting for a given child process to finish running,
+// or if 'cp' is NULL, for whichever child stops first.
 // Parent process 'p' must be running and locked on entry.
 // The supplied trapframe represents p's register state on syscall entry.
 void gcc_noreturn
@@ -116,16 +263,24 @@ proc_wait(proc *p, proc *cp, trapframe *tf)
 {
 	//panic("proc_wait not implemented");
   assert(spinlock_holding(&p->lock));
-  assert(cp && cp != &proc_null); // null proc is always stopped
-  assert(cp->state != PROC_STOP);
+  assert(cp != &proc_null); // null proc is always stopped
+  assert(cp == NULL || cp->state != PROC_STOP);
 
   p->state = PROC_WAIT;
   p->runcpu = NULL;
   p->waitchild = cp;  // remember what child we're waiting on
+  p->waitany = cp == NULL;
   proc_save(p, tf, 0);  // save process state before INT instruction
 
   spinlock_release(&p->lock);
 
+  // If the child is just waiting its turn, hand it our CPU right away
+  // rather than letting an unrelated process go first.
+  if (cp != NULL && proc_readytake(cp)) {
+    cpu_cur()->handoffs++;
+    proc_run(cp);
+  }
+
   proc_sched();
 }
 
@@ -133,35 +288,44 @@ void gcc_noreturn
 proc_sched(void)
 {
 //	panic("proc_sched not implemented");
+  // Run our own oldest ready process, or else steal someone else's.
   cpu *c = cpu_cur();
-  spinlock_acquire(&readylock);
-  while (!readyhead || cpu_disabled(c)) {
-    spinlock_release(&readylock);
+  proc *p;
+  while (cpu_disabled(c)
+      || ((p = proc_readypop(c)) == NULL && (p = proc_steal(c)) == NULL)) {
+    // Idle in the kernel's own address space: the last process's pdir
+    // may be freed while we wait, and the idle work uses kmap slots.
+    lcr3(mem_phys(pmap_bootpdir));
 
     //cprintf("cpu %d waiting for work\n", cpu_cur()->id);
-    while (!readyhead || cpu_disabled(c)) {  // spin-wait for work
-      sti(); // enable device interrupts briefly
-      pause(); // let CPU know we're in a spin loop
-      cli(); // disable interrupts again
+    while (!proc_anyready() || cpu_disabled(c)) {  // wait for work
+      if (pmap_mergeidle() // use the wait to help another CPU merge,
+          || pmap_deferidle() // or to free unmapped memory,
+          || mem_zero_idle() // or to pre-zero a free page,
+          || dedup_idle()) { // or else to look for duplicate pages
+        sti(); // enable device interrupts briefly
+        pause(); // let CPU know we're in a spin loop
+        cli(); // disable interrupts again
+        continue;
+      }
+
+      // Nothing to do: halt until the next timer tick or device interrupt,
+      // or until cpu_wake() sees our flag and sends us an IPI.
+      // The xchg orders setting the flag before checking the queues,
+      // as proc_ready() fills a queue before checking the flag.
+      xchg(&c->halted, 1);
+      if (!proc_anyready()) {
+        uint64_t start = rdtsc();
+        sti_hlt();
+        cli();
+        c->idlecycles += rdtsc() - start;
+      }
+      c->halted = 0;
     }
     //cprintf("cpu %d found work\n", cpu_cur()->id);
-
-    spinlock_acquire(&readylock);
-    // now must recheck readyhead while holding readylock!
+    // now must recheck the queues while holding their locks!
   }
 
-  // Remove the next proc from the ready queue
-  proc *p = readyhead;
-  readyhead = p->readynext;
-  if (readytail == &p->readynext) {
-    assert(readyhead == NULL); // ready queue going empty
-    readytail = &readyhead;
-  }
-  p->readynext = NULL;
-
-  spinlock_acquire(&p->lock);
-  spinlock_release(&readylock);
-
   proc_run(p);
 }	
 
@@ -178,6 +342,7 @@ proc_run(proc *p)
 
   spinlock_release(&p->lock);
 
+  pmap_invalcancel();	// the CR3 load flushes the TLB anyway
   lcr3(mem_phys(p->pdir));
   trap_return(&p->sv.tf);
 }
@@ -222,17 +387,33 @@ proc_ret(trapframe *tf, int entry)
 
   cp->state = PROC_STOP; // we're becoming stopped
   cp->runcpu = NULL; // no longer running
+  cp->newstop = 1; // for the parent's next wait-any GET
   proc_save(cp, tf, entry);  // save process state after INT insn
 
   // If parent is waiting to sync with us, wake it up.
-  if (p->state == PROC_WAIT && p->waitchild == cp) {
+  if (p->state == PROC_WAIT && (p->waitchild == cp || p->waitany)) {
     p->waitchild = NULL;
+    p->waitany = 0;
     proc_run(p);
   }
 
   spinlock_release(&p->lock);
   proc_sched();  // find and run someone else
 }
+// Print each CPU's ready queue length, how many processes it stole
+// or was handed by proc_wait(), and how long it spent halted.
+void
+proc_stats(void)
+{
+	uint64_t khz = pit_tscfreq() / 1000;
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		cprintf("cpu%d: %d processes ready, %d stolen, "
+			"%d handed off; %dms idle, %d wakeups\n",
+			c->id, c->nready, c->steals, c->handoffs,
+			(uint32_t)(c->idlecycles / khz), c->wakeups);
+}
+
 // Helper functions for proc_check()
 static void child(int n);
 static void grandchild(int n);
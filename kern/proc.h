@@ -31,7 +31,7 @@ typedef enum proc_state {
 } proc_state;
 
 // Thread control block structure.
-// Consumes 1 physical memory page, though we don't use all of it.
+// Allocated from a slab cache, which packs two of them into a page.
 typedef struct proc {
 
 	// Master spinlock protecting proc's state.
@@ -40,12 +40,16 @@ typedef struct proc {
 	// Process hierarchy information.
 	struct proc	*parent;
 	struct proc	*child[PROC_CHILDREN];
+	struct proc	*allnext;	// chain on list of all procs
 
 	// Scheduling state for this process.
 	proc_state	state;		// current state
 	struct proc	*readynext;	// chain on ready queue
+	struct cpu	*readycpu;	// cpu whose ready queue we're on
 	struct cpu	*runcpu;	// cpu we're running on if running
 	struct proc	*waitchild;	// child proc if waiting for child
+	bool		waitany;	// waiting for whichever child stops
+	bool		newstop;	// stopped since parent's last GET/PUT
 
 	// Save area for user-visible state when process is not running.
 	procstate	sv;
@@ -53,6 +57,17 @@ typedef struct proc {
 	// Virtual memory state for this process.
 	pde_t		*pdir;		// Working page directory
 	pde_t		*rpdir;		// Reference page directory
+	bool		snapmerged;	// Merged since the last snapshot
+	bool		snaplost;	// Snapshot dropped by proc_reclaim()
+	uint32_t	snaplo;		// Region a SYS_SNAPONLY snapshot covers;
+	uint32_t	snaphi;		// both 0 if it covers everything
+	struct proc	*opchild;	// Child of our current PUT or GET
+
+	// Write faults, see pmap_pagefault().
+	uint32_t	faultnext;	// Page just past the last fault's window
+	uint32_t	faultwin;	// Pages that fault resolved
+	uint32_t	faults;		// Write faults resolved
+	uint32_t	faultpages;	// Pages they made writable
 } proc;
 
 #define proc_cur()	(cpu_cur()->proc)
@@ -64,6 +79,10 @@ extern proc proc_null;
 // Special root process - the only one that can do direct external I/O.
 extern proc *proc_root;
 
+// List of all processes, for scanners such as kern/dedup.c.
+// Procs are only ever added, at the head, so it's safe to walk unlocked.
+extern proc *proc_all;
+
 proc *ready_pop(void);
 void ready_push(proc *p);
 
@@ -76,6 +95,7 @@ void proc_sched(void) gcc_noreturn;	// Find and run some ready process
 void proc_run(proc *p) gcc_noreturn;	// Run a specific process
 void proc_yield(trapframe *tf) gcc_noreturn;	// Yield to another process
 void proc_ret(trapframe *tf, int entry) gcc_noreturn;	// Return to parent
+void proc_stats(void);			// Print scheduling statistics
 void proc_check(void);			// Check process code
 
 
@@ -0,0 +1,287 @@
+/*
+ * Slab allocator for small kernel objects.
+ *
+ * Each cache carves whole pages from mem_alloc() into equal-sized objects.
+ * Objects are handed out through short per-CPU free lists in the cpu struct,
+ * which are refilled from and drained to the cache's slabs in batches.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/slab.h>
+
+
+static slab_cache *slab_caches[SLAB_MAXCACHES];	// All caches, by id
+static int slab_ncaches;
+
+// The free-list link word stored just past each object.
+#define slab_link(sc, obj)	((void **) ((char*)(obj) + (sc)->size))
+
+// The slab header at the start of the page holding an object.
+#define slab_of(obj)		((slab *) ROUNDDOWN((uint32_t)(obj), PAGESIZE))
+
+
+void
+slab_init(slab_cache *sc, const char *name, size_t size, size_t align,
+		void (*ctor)(void *obj))
+{
+	assert(align >= sizeof(void*) && (align & (align-1)) == 0);
+	assert(slab_ncaches < SLAB_MAXCACHES);
+
+	memset(sc, 0, sizeof(*sc));
+	sc->name = name;
+	sc->size = ROUNDUP(size, sizeof(void*));
+	sc->slot = ROUNDUP(sc->size + sizeof(void*), align);
+	sc->offset = ROUNDUP(sizeof(slab), align);
+	sc->perslab = (PAGESIZE - sc->offset) / sc->slot;
+	assert(sc->perslab >= 1);
+	sc->ctor = ctor;
+	spinlock_init(&sc->lock);
+
+	sc->id = slab_ncaches;
+	slab_caches[slab_ncaches++] = sc;
+}
+
+//
+// Allocate and construct a new slab, and put it on the partial list.
+// Called with the cache locked.
+//
+static slab *
+slab_grow(slab_cache *sc)
+{
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return NULL;
+	mem_incref(pi);
+
+	slab *s = mem_pi2ptr(pi);
+	s->cache = sc;
+	s->inuse = 0;
+	s->free = NULL;
+
+	// Link the objects so that the lowest one is handed out first.
+	int i;
+	for (i = sc->perslab - 1; i >= 0; i--) {
+		void *obj = (char*)s + sc->offset + i * sc->slot;
+		if (sc->ctor)
+			sc->ctor(obj);
+		*slab_link(sc, obj) = s->free;
+		s->free = obj;
+	}
+
+	s->next = sc->partial;
+	s->prev = &sc->partial;
+	if (s->next != NULL)
+		s->next->prev = &s->next;
+	sc->partial = s;
+	sc->nslabs++;
+	return s;
+}
+
+// Take slab s off the cache's partial list.
+static void
+slab_unlink(slab *s)
+{
+	*s->prev = s->next;
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+	s->next = NULL;
+	s->prev = NULL;
+}
+
+//
+// Move up to n objects from the cache's slabs to CPU list cc,
+// growing the cache if it has no free objects left.
+//
+static void
+slab_fill(slab_cache *sc, slab_cpucache *cc, int n)
+{
+	spinlock_acquire(&sc->lock);
+	while (n > 0) {
+		slab *s = sc->partial;
+		if (s == NULL && (s = slab_grow(sc)) == NULL)
+			break;
+
+		while (n > 0 && s->free != NULL) {
+			void *obj = s->free;
+			s->free = *slab_link(sc, obj);
+			s->inuse++;
+			*slab_link(sc, obj) = cc->free;
+			cc->free = obj;
+			cc->nfree++;
+			n--;
+		}
+		if (s->free == NULL)		// slab is now full
+			slab_unlink(s);
+	}
+	spinlock_release(&sc->lock);
+}
+
+//
+// Return n objects from CPU list cc to their slabs.
+// A slab that becomes entirely free goes back to mem_free(),
+// unless it is the only slab with free objects left.
+//
+static void
+slab_drain(slab_cache *sc, slab_cpucache *cc, int n)
+{
+	assert(n <= cc->nfree);
+	spinlock_acquire(&sc->lock);
+	while (n-- > 0) {
+		void *obj = cc->free;
+		cc->free = *slab_link(sc, obj);
+		cc->nfree--;
+
+		slab *s = slab_of(obj);
+		assert(s->cache == sc && s->inuse > 0);
+		if (s->free == NULL) {		// was full: make it partial
+			s->next = sc->partial;
+			s->prev = &sc->partial;
+			if (s->next != NULL)
+				s->next->prev = &s->next;
+			sc->partial = s;
+		}
+		*slab_link(sc, obj) = s->free;
+		s->free = obj;
+		s->inuse--;
+
+		if (s->inuse == 0 && (sc->partial != s || s->next != NULL)) {
+			slab_unlink(s);
+			sc->nslabs--;
+			mem_decref(mem_ptr2pi(s), mem_free);
+		}
+	}
+	spinlock_release(&sc->lock);
+}
+
+void *
+slab_alloc(slab_cache *sc)
+{
+	slab_cpucache *cc = &cpu_cur()->slab[sc->id];
+	if (cc->nfree > 0)
+		cc->hits++;
+	else {
+		cc->misses++;
+		slab_fill(sc, cc, SLAB_BATCH);
+		if (cc->nfree == 0)
+			return NULL;
+	}
+
+	void *obj = cc->free;
+	cc->free = *slab_link(sc, obj);
+	cc->nfree--;
+	return obj;
+}
+
+void
+slab_free(slab_cache *sc, void *obj)
+{
+	assert(slab_of(obj)->cache == sc);
+
+	slab_cpucache *cc = &cpu_cur()->slab[sc->id];
+	if (cc->nfree >= SLAB_CPUMAX)
+		slab_drain(sc, cc, SLAB_BATCH);
+	*slab_link(sc, obj) = cc->free;
+	cc->free = obj;
+	cc->nfree++;
+}
+
+void
+slab_stats(void)
+{
+	int i;
+	for (i = 0; i < slab_ncaches; i++) {
+		slab_cache *sc = slab_caches[i];
+
+		// Objects cached on CPUs count as free.
+		int cached = 0;
+		cpu *c;
+		for (c = &cpu_boot; c != NULL; c = c->next)
+			cached += c->slab[sc->id].nfree;
+
+		spinlock_acquire(&sc->lock);
+		int total = sc->nslabs * sc->perslab;
+		int nslabs = sc->nslabs;
+		int slabfree = 0;
+		slab *s;
+		for (s = sc->partial; s != NULL; s = s->next)
+			slabfree += sc->perslab - s->inuse;
+		spinlock_release(&sc->lock);
+
+		int inuse = total - slabfree - cached;
+		cprintf("slab %s: %d of %d objects in use (%d%%), "
+			"%d slabs of %d x %d bytes\n",
+			sc->name, inuse, total,
+			total ? inuse * 100 / total : 0,
+			nslabs, sc->perslab, sc->size);
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			slab_cpucache *cc = &c->slab[sc->id];
+			cprintf("  cpu%d: %d cached, %d hits %d misses\n",
+				c->id, cc->nfree, cc->hits, cc->misses);
+		}
+	}
+}
+
+static int slab_check_ctors;
+
+static void
+slab_check_ctor(void *obj)
+{
+	memset(obj, 0xa5, 100);
+	slab_check_ctors++;
+}
+
+void
+slab_check(void)
+{
+	static slab_cache sc;
+	cpu *c = cpu_cur();
+	int i;
+
+	// 100-byte objects, 64-byte aligned: 128-byte slots, 31 per slab.
+	slab_init(&sc, "check", 100, 64, slab_check_ctor);
+	assert(sc.slot == 128 && sc.perslab == (PAGESIZE - 64) / 128);
+	slab_cpucache *cc = &c->slab[sc.id];
+
+	// The first allocation grows one slab and moves a batch to this CPU;
+	// every object arrives constructed, and is aligned.
+	void *objs[2 * (PAGESIZE - 64) / 128];
+	objs[0] = slab_alloc(&sc); assert(objs[0] != NULL);
+	assert(sc.nslabs == 1 && slab_check_ctors == sc.perslab);
+	assert(cc->misses == 1 && cc->nfree == SLAB_BATCH-1);
+	assert(((uint32_t)objs[0] & 63) == 0);
+	assert(((uint8_t*)objs[0])[99] == 0xa5);
+
+	// A freed object is handed straight back by the next allocation.
+	slab_free(&sc, objs[0]);
+	assert(slab_alloc(&sc) == objs[0] && cc->hits == 1);
+
+	// Fill more than a slab: a second slab appears.
+	for (i = 1; i < sc.perslab + 1; i++) {
+		objs[i] = slab_alloc(&sc); assert(objs[i] != NULL);
+		assert(objs[i] != objs[i-1]);
+	}
+	assert(sc.nslabs == 2);
+
+	// Free everything: the per-CPU list drains back to the slabs
+	// and an empty slab is released, but one slab is kept.
+	for (i = 0; i < sc.perslab + 1; i++)
+		slab_free(&sc, objs[i]);
+	assert(cc->nfree <= SLAB_CPUMAX);
+	slab_drain(&sc, cc, cc->nfree);
+	assert(sc.nslabs == 1);
+	assert(sc.partial->inuse == 0 && sc.partial->next == NULL);
+
+	// Give the last slab back and retire the cache.
+	mem_decref(mem_ptr2pi(sc.partial), mem_free);
+	slab_caches[--slab_ncaches] = NULL;
+	memset(cc, 0, sizeof(*cc));
+
+	cprintf("slab_check() succeeded!\n");
+}
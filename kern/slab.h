@@ -0,0 +1,79 @@
+/*
+ * Slab allocator for small kernel objects.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_SLAB_H
+#define PIOS_KERN_SLAB_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/spinlock.h>
+
+
+#define SLAB_MAXCACHES	8	// Max number of object caches
+#define SLAB_CPUMAX	8	// Max free objects kept per CPU per cache
+#define SLAB_BATCH	4	// Objects moved at a time to/from a CPU
+
+// Header at the start of each page-sized slab.
+// The objects follow, each with a free-list link word after it,
+// so that a free object keeps its constructed contents.
+typedef struct slab {
+	struct slab_cache *cache;	// Cache this slab belongs to
+	struct slab	*next;		// Next slab on cache's partial list
+	struct slab	**prev;		// Link pointing to us, if on the list
+	void		*free;		// Free objects in this slab
+	int		inuse;		// Objects handed out of this slab
+} slab;
+
+// An object cache: a set of slabs holding objects of one type.
+typedef struct slab_cache {
+	const char	*name;		// For slab_stats()
+	size_t		size;		// Object size
+	size_t		slot;		// Object plus link, rounded to align
+	size_t		offset;		// Offset of the first object in a slab
+	int		perslab;	// Objects per slab
+	int		id;		// Index into each cpu's slab[] array
+	void		(*ctor)(void *obj);	// Object constructor, or NULL
+
+	spinlock	lock;		// Protects the fields below
+	slab		*partial;	// Slabs with some free objects
+	int		nslabs;		// Pages currently held
+} slab_cache;
+
+// Each CPU keeps a short list of free objects for each cache
+// in its cpu struct, so most allocations and frees take no lock.
+typedef struct slab_cpucache {
+	void		*free;		// Free objects, linked as in slabs
+	int		nfree;		// Number of objects on the list
+	uint32_t	hits;		// slab_alloc()s served from the list
+	uint32_t	misses;		// slab_alloc()s that refilled the list
+} slab_cpucache;
+
+
+// Set up a statically allocated object cache.
+// Objects are 'size' bytes, aligned to 'align' (a power of two),
+// and at most about a page.  If 'ctor' is non-NULL, it is applied to
+// each object once, when the object's slab is created;
+// callers must return objects to slab_free() in that constructed state.
+void slab_init(slab_cache *sc, const char *name, size_t size, size_t align,
+		void (*ctor)(void *obj));
+
+// Allocate an object, or return NULL if out of physical memory.
+void *slab_alloc(slab_cache *sc);
+
+// Free an object allocated from cache 'sc'.
+void slab_free(slab_cache *sc, void *obj);
+
+// Print per-cache occupancy and per-CPU hit rates to the console.
+void slab_stats(void);
+
+// Check the slab allocator for correct operation.
+void slab_check(void);
+
+#endif /* !PIOS_KERN_SLAB_H */
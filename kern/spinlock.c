@@ -41,6 +41,19 @@ spinlock_acquire(struct spinlock *lk)
   debug_trace(read_ebp(), lk->eips);
 }
 
+// Acquire the lock only if it is free right now; return true if we got it.
+// For code that may run with other locks already held,
+// and can't take this one in the usual order.
+int
+spinlock_try(struct spinlock *lk)
+{
+  if (spinlock_holding(lk) || xchg(&lk->locked, 1) != 0)
+    return 0;
+  lk->cpu = cpu_cur();
+  debug_trace(read_ebp(), lk->eips);
+  return 1;
+}
+
 // Release the lock.
 void
 spinlock_release(struct spinlock *lk)
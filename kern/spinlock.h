@@ -35,6 +35,7 @@ typedef struct spinlock {
 
 void spinlock_init_(spinlock *lk, const char *file, int line);
 void spinlock_acquire(spinlock *lk);
+int spinlock_try(spinlock *lk);
 void spinlock_release(spinlock *lk);
 int spinlock_holding(spinlock *lk);
 void spinlock_check();
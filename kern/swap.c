@@ -0,0 +1,274 @@
+/*
+ * Swapping of cold user pages to disk.
+ *
+ * Swap space is a raw disk (qemu -hdb) divided into page-sized slots.
+ * Under memory pressure, mem_reclaim() calls swap_reclaim(),
+ * which sweeps a clock hand through the page tables of processes
+ * that can't run meanwhile: pages accessed since the last sweep
+ * only lose their PTE_A bit; unshared pages that weren't are written out,
+ * leaving a PTE_SWAP entry behind for pmap_pagefault() to swap back in.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/vm.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/pmap.h>
+#include <kern/proc.h>
+#include <kern/swap.h>
+
+#include <dev/ide.h>
+
+
+#define SWAP_SECTS	(PAGESIZE / IDE_SECTSIZE)
+
+static spinlock swap_lock;	// Protects the slot fields below
+static uint16_t swap_refs[SWAP_MAXSLOTS];	// References to each slot
+static uint32_t swap_nslots;	// Slots on the swap disk; 0 if no swap
+static uint32_t swap_nused;	// Slots in use
+static uint32_t swap_hint;	// Where to look for a free slot next
+
+// The clock hand: only one CPU sweeps at a time.
+static spinlock swap_scanlock;
+static proc *swap_proc;		// Process being swept
+static uint32_t swap_va;	// Next user address to look at in it
+
+static void swap_reclaim(size_t target);
+
+
+void
+swap_init(void)
+{
+	if (!cpu_onboot())
+		return;
+
+	spinlock_init(&swap_lock);
+	spinlock_init(&swap_scanlock);
+
+	uint32_t nsects = ide_init(IDE_SWAPDISK);
+	swap_nslots = MIN(nsects / SWAP_SECTS, SWAP_MAXSLOTS);
+	if (swap_nslots < 2) {		// slot 0 is never used
+		swap_nslots = 0;
+		cprintf("swap: no swap disk\n");
+		return;
+	}
+	cprintf("swap: %dKB on IDE disk %d\n",
+		swap_nslots * (PAGESIZE / 1024), IDE_SWAPDISK);
+	mem_reclaim_register(swap_reclaim);
+}
+
+// Allocate a free swap slot with one reference, or return 0 if full.
+static uint32_t
+swap_alloc(void)
+{
+	spinlock_acquire(&swap_lock);
+	uint32_t i, slot = 0;
+	for (i = 0; i < swap_nslots; i++) {
+		uint32_t s = (swap_hint + i) % swap_nslots;
+		if (s != 0 && swap_refs[s] == 0) {
+			slot = s;
+			swap_refs[s] = 1;
+			swap_nused++;
+			swap_hint = s + 1;
+			break;
+		}
+	}
+	spinlock_release(&swap_lock);
+	return slot;
+}
+
+void
+swap_incref(uint32_t slot)
+{
+	spinlock_acquire(&swap_lock);
+	assert(slot > 0 && slot < swap_nslots);
+	assert(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_decref(uint32_t slot)
+{
+	spinlock_acquire(&swap_lock);
+	assert(slot > 0 && slot < swap_nslots);
+	assert(swap_refs[slot] > 0);
+	if (--swap_refs[slot] == 0)
+		swap_nused--;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_read(uint32_t slot, void *dst)
+{
+	if (!ide_read(IDE_SWAPDISK, slot * SWAP_SECTS, dst, SWAP_SECTS))
+		panic("swap_read: disk error reading slot %d", slot);
+	cpu_cur()->swapins++;
+}
+
+bool
+swap_in(pte_t *pte)
+{
+	assert(!(*pte & PTE_P) && (*pte & PTE_SWAP));
+	pageinfo *pi = mem_alloc_high();
+	if (pi == NULL)
+		return 0;
+	mem_incref(pi);
+
+	uint32_t slot = swap_slot(*pte);
+	swap_read(slot, pmap_kmap(mem_pi2phys(pi), PMAP_KMAP_DST));
+
+	// The page is ours alone, so it can be writable right away.
+	uint32_t nominal = *pte & SYS_RW;
+	*pte = mem_pi2phys(pi) | nominal | PTE_A | PTE_U | PTE_P
+		| ((nominal & SYS_WRITE) ? PTE_W : 0);
+	swap_decref(slot);
+	return 1;
+}
+
+//
+// Write out the page mapped by 'pte', which nothing else refers to.
+// Runs inside mem_alloc(), so it uses the kmap slot that no caller
+// of mem_alloc() holds across the call.
+//
+static bool
+swap_out(pte_t *pte)
+{
+	uint32_t slot = swap_alloc();
+	if (slot == 0)
+		return 0;
+
+	uint32_t pa = PGADDR(*pte);
+	if (!ide_write(IDE_SWAPDISK, slot * SWAP_SECTS,
+			pmap_kmap(pa, PMAP_KMAP_TMP), SWAP_SECTS)) {
+		cprintf("swap_out: disk error writing slot %d\n", slot);
+		swap_decref(slot);
+		return 0;
+	}
+
+	*pte = swap_pte(slot) | (*pte & SYS_RW);
+	mem_decref(mem_phys2pi(pa), mem_free);
+	cpu_cur()->swapouts++;
+	return 1;
+}
+
+//
+// Can we edit process p's page tables right now?
+// If so, return true with *lk set to the lock keeping it that way, if any.
+// Ready and waiting processes can't run while we hold their own lock.
+// A stopped process is controlled by its parent, which can't run
+// while we hold the parent's lock - unless it's us, in which case
+// only the child of the PUT or GET we might be in is off limits.
+// We may be called with any other locks held, so we only try locks.
+//
+static bool
+swap_lockproc(proc *p, spinlock **lk)
+{
+	*lk = NULL;
+	if (p->state == PROC_STOP) {
+		proc *pp = p->parent;
+		if (pp == NULL)
+			return 0;
+		if (pp == proc_cur() && pp->state == PROC_RUN
+				&& pp->runcpu == cpu_cur())
+			return p != pp->opchild;
+		if (!spinlock_try(&pp->lock))
+			return 0;
+		if (pp->state == PROC_RUN || p->state != PROC_STOP) {
+			spinlock_release(&pp->lock);
+			return 0;
+		}
+		*lk = &pp->lock;
+		return 1;
+	}
+
+	if (!spinlock_try(&p->lock))
+		return 0;
+	if (p->state != PROC_READY && p->state != PROC_WAIT) {
+		spinlock_release(&p->lock);
+		return 0;
+	}
+	*lk = &p->lock;
+	return 1;
+}
+
+//
+// Memory reclaimer: sweep the clock hand until enough pages are free,
+// SWAP_BATCH pages have been written out, or SWAP_SCAN PTEs looked at.
+//
+static void
+swap_reclaim(size_t target)
+{
+	if (!spinlock_try(&swap_scanlock))	// another CPU is sweeping
+		return;
+
+	int scanned = 0, evicted = 0;
+	bool full = 0;
+	while (scanned < SWAP_SCAN && evicted < SWAP_BATCH && !full
+			&& mem_nfree < target) {
+		if (swap_proc == NULL) {		// start a new sweep
+			swap_proc = proc_all;
+			swap_va = VM_USERLO;
+			if (swap_proc == NULL)
+				break;
+		}
+		proc *p = swap_proc;
+		spinlock *lk;
+		scanned++;
+		if (swap_va >= VM_USERHI || !swap_lockproc(p, &lk)) {
+			swap_proc = p->allnext;
+			swap_va = VM_USERLO;
+			continue;
+		}
+
+		// Shared page tables may be in use elsewhere: skip them.
+		// Superpages map memory in active use: skip those too.
+		pde_t *pde = &p->pdir[PDX(swap_va)];
+		if (!(*pde & PTE_P) || (*pde & PTE_PS)
+				|| mem_phys2pi(PGADDR(*pde))->refcount != 1)
+			swap_va = PTADDR(swap_va + PTSIZE);
+		else {
+			pte_t *ptab = mem_ptr(PGADDR(*pde));
+			do {
+				pte_t *pte = &ptab[PTX(swap_va)];
+				swap_va += PAGESIZE;
+				scanned++;
+				uint32_t pa = PGADDR(*pte);
+				if (!(*pte & PTE_P) || pa == PTE_ZERO
+					|| mem_phys2pi(pa)->refcount != 1)
+					continue;
+				if (*pte & PTE_A) {	// used lately: next time
+					*pte &= ~PTE_A;
+					continue;
+				}
+				if (!swap_out(pte))
+					full = 1;
+				else
+					evicted++;
+			} while (PTX(swap_va) != 0 && !full
+				&& evicted < SWAP_BATCH && mem_nfree < target);
+		}
+
+		if (lk != NULL)
+			spinlock_release(lk);
+	}
+
+	spinlock_release(&swap_scanlock);
+}
+
+void
+swap_stats(void)
+{
+	if (swap_nslots == 0)
+		return;
+	cprintf("swap: %d of %d slots in use\n", swap_nused, swap_nslots - 1);
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		cprintf("cpu%d: %d pages swapped out, %d swapped in\n",
+			c->id, c->swapouts, c->swapins);
+}
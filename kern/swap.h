@@ -0,0 +1,51 @@
+/*
+ * Swapping of cold user pages to disk.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_SWAP_H
+#define PIOS_KERN_SWAP_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+
+// A PTE for a page that is out on disk has PTE_P clear and PTE_SWAP set,
+// and holds the swap slot number where a page address would normally be.
+// Its nominal permissions (SYS_READ and SYS_WRITE) are kept as usual.
+// Like a page, a slot is reference counted, since page tables
+// that share a swapped-out PTE may later be copied.
+#define PTE_SWAP	0x800	// In PTE_AVAIL, next to SYS_READ/SYS_WRITE
+
+#define swap_pte(slot)	((slot) * PAGESIZE | PTE_SWAP)
+#define swap_slot(pte)	(PGADDR(pte) / PAGESIZE)
+
+#define SWAP_MAXSLOTS	16384	// Max swap space, in pages (64MB)
+#define SWAP_BATCH	64	// Max pages written out per mem_reclaim()
+#define SWAP_SCAN	16384	// Max PTEs looked at per mem_reclaim()
+
+
+// Find the swap disk, if there is one, and register the swap reclaimer.
+void swap_init(void);
+
+// Take or drop a reference to a swap slot.
+void swap_incref(uint32_t slot);
+void swap_decref(uint32_t slot);
+
+// Read the page in swap slot 'slot' into the kernel page at 'dst'.
+void swap_read(uint32_t slot, void *dst);
+
+// Bring the page for swapped-out PTE 'pte' back into memory,
+// in a page table that is private to the process using it.
+// Returns false if there is no memory for the page.
+bool swap_in(pte_t *pte);
+
+// Print swap space usage and per-CPU swap-in/swap-out counts.
+void swap_stats(void);
+
+#endif /* !PIOS_KERN_SWAP_H */
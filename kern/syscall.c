@@ -81,6 +81,7 @@ static void checkva(trapframe *utf, uint32_t uva, size_t size)
 void usercopy(trapframe *utf, bool copyout, void *kva, uint32_t uva, size_t size)
 {
 	checkva(utf, uva, size);
+	pmap_invalflush();	// user mappings must be up to date
 	cpu *c = cpu_cur();
 	assert(c->recover == NULL);
 	c->recover = sysrecover;
@@ -104,51 +105,28 @@ buf[CPUTS_MAX] = 0;
 cprintf("%s",buf);
 	trap_return(tf);	// syscall completed
 }
-static void
-do_put(trapframe *tf, uint32_t cmd)
+// Find the range of children a PUT or GET applies to:
+// child number 'cn' in EDX bits 7-0, and with SYS_RANGE,
+// that many children from there in EDX bits 31-16; returns how many.
+static uint32_t
+syschildren(trapframe *tf, uint32_t cmd, uint32_t *cn)
 {
-	proc *p = proc_cur();
-	assert(p->state == PROC_RUN && p->runcpu == cpu_cur());
-//cprintf("PUT proc %x eip %x esp %x cmd %x\n", p, tf->eip, tf->esp, cmd);
-
-	spinlock_acquire(&p->lock);
-
-	// Find the named child process; create if it doesn't exist
-	uint32_t cn = tf->regs.edx & 0xff;
-	proc *cp = p->child[cn];
-	if (!cp) {
-		cp = proc_alloc(p, cn);
-		if (!cp)	// XX handle more gracefully
-			panic("sys_put: no memory for child");
-	}
-
-	// Synchronize with child if necessary.
-	if (cp->state != PROC_STOP)
-		proc_wait(p, cp, tf);
-
-	// Since the child is now stopped, it's ours to control;
-	// we no longer need our process lock -
-	// and we don't want to be holding it if usercopy() below aborts.
-	spinlock_release(&p->lock);
-
-	// Put child's general register state
-	if (cmd & SYS_REGS) {
-		int len = offsetof(procstate, fx);  // just integer regs
-		if (cmd & SYS_FPU) len = sizeof(procstate); // whole shebang
+	*cn = tf->regs.edx & 0xff;
+	if (!(cmd & SYS_RANGE))
+		return 1;
+	uint32_t n = tf->regs.edx >> 16;
+	if (n == 0 || n > PROC_CHILDREN - *cn)
+		systrap(tf, T_GPFLT, 0);
+	return n;
+}
 
-		usercopy(tf,0,&cp->sv, tf->regs.ebx, len);
-		// Copy user's trapframe into child process
-		procstate *cs = (procstate*) tf->regs.ebx;
-		memcpy(&cp->sv, cs, len);
+// Do a PUT's memory operations on child 'cp', which is stopped.
+static void
+put_child(trapframe *tf, uint32_t cmd, proc *p, proc *cp)
+{
+	p->opchild = cp;	// keep proc_reclaim() off it
+	cp->newstop = 0;
 
-		// Make sure process uses user-mode segments and eflag settings
-		cp->sv.tf.ds = CPU_GDT_UDATA | 3;
-		cp->sv.tf.es = CPU_GDT_UDATA | 3;
-		cp->sv.tf.cs = CPU_GDT_UCODE | 3;
-		cp->sv.tf.ss = CPU_GDT_UDATA | 3;
-		cp->sv.tf.eflags &= FL_USER;
-		cp->sv.tf.eflags |= FL_IF;  // enable interrupts
-	}
 	uint32_t sva = tf->regs.esi;
 	uint32_t dva = tf->regs.edi;
 	uint32_t size = tf->regs.ecx;
@@ -157,14 +135,14 @@ do_put(trapframe *tf, uint32_t cmd)
 			break;
 		case SYS_COPY:
 			// validate source region
-			if (PTOFF(sva) || PTOFF(size)
+			if (PGOFF(sva) || PGOFF(size)
 					|| sva < VM_USERLO || sva > VM_USERHI
 					|| size > VM_USERHI-sva)
 				systrap(tf, T_GPFLT, 0);
 			// fall thru...
 		case SYS_ZERO:
 			// validate destination region
-			if (PTOFF(dva) || PTOFF(size)
+			if (PGOFF(dva) || PGOFF(size)
 					|| dva < VM_USERLO || dva > VM_USERHI
 					|| size > VM_USERHI-dva)
 				systrap(tf, T_GPFLT, 0);
@@ -174,7 +152,9 @@ do_put(trapframe *tf, uint32_t cmd)
 					pmap_remove(cp->pdir, dva, size);
 					break;
 				case SYS_COPY:	// copy from local src to dest in child
-					pmap_copy(p->pdir, sva, cp->pdir, dva, size);
+					if (!pmap_copy(p->pdir, sva,
+							cp->pdir, dva, size))
+						systrap(tf, T_NOMEM, 0);
 					break;
 			}
 			break;
@@ -189,54 +169,134 @@ do_put(trapframe *tf, uint32_t cmd)
 				|| size > VM_USERHI-dva)
 			systrap(tf, T_GPFLT, 0);
 		if (!pmap_setperm(cp->pdir, dva, size, cmd & SYS_RW))
-			panic("pmap_put: no memory to set permissions");
+			systrap(tf, T_NOMEM, 0);
+	}
+
+	if (cmd & SYS_UNSNAP) {	// Drop child's old snapshot
+		pmap_remove(cp->rpdir, VM_USERLO, VM_USERHI-VM_USERLO);
+		cp->snaplo = cp->snaphi = 0;
+	}
+
+	// Snapshot child's state: everything, or with SYS_SNAPONLY
+	// just the region copied in, which is all a later merge may look at.
+	// Page tables the old snapshot already shares cost nothing to keep.
+	if (cmd & SYS_SNAP) {
+		uint32_t snaplo = VM_USERLO, snaphi = VM_USERHI;
+		if (cmd & SYS_SNAPONLY)
+			snaplo = dva, snaphi = dva + size;
+		if (snaplo > VM_USERLO)
+			pmap_remove(cp->rpdir, VM_USERLO, snaplo - VM_USERLO);
+		if (snaphi < VM_USERHI)
+			pmap_remove(cp->rpdir, snaphi, VM_USERHI - snaphi);
+		if (snaphi > snaplo && !pmap_copy(cp->pdir, snaplo,
+				cp->rpdir, snaplo, snaphi - snaplo))
+			systrap(tf, T_NOMEM, 0);
+		cp->snaplo = (cmd & SYS_SNAPONLY) ? snaplo : 0;
+		cp->snaphi = (cmd & SYS_SNAPONLY) ? snaphi : 0;
 	}
 
-	if (cmd & SYS_SNAP)	// Snapshot child's state
-		pmap_copy(cp->pdir, VM_USERLO, cp->rpdir, VM_USERLO,
-				VM_USERHI-VM_USERLO);
+	if (cmd & (SYS_SNAP | SYS_UNSNAP))	// A fresh start, or none at all
+		cp->snapmerged = cp->snaplost = 0;
 
 	// Start the child if requested
 	if (cmd & SYS_START)
 		proc_ready(cp);
-
-	trap_return(tf);  // syscall completed
 }
 
-  static void
-do_get(trapframe *tf, uint32_t cmd)
+static void
+do_put(trapframe *tf, uint32_t cmd)
 {
-  proc *p = proc_cur();
-  assert(p->state == PROC_RUN && p->runcpu == cpu_cur());
-  //cprintf("GET proc %x eip %x esp %x cmd %x\n", p, tf->eip, tf->esp, cmd);
+	proc *p = proc_cur();
+	assert(p->state == PROC_RUN && p->runcpu == cpu_cur());
+//cprintf("PUT proc %x eip %x esp %x cmd %x\n", p, tf->eip, tf->esp, cmd);
 
-  spinlock_acquire(&p->lock);
+	if (cmd & SYS_ANY)
+		systrap(tf, T_GPFLT, 0);	// only valid for GET
+	if ((cmd & SYS_SNAPONLY) && ((cmd & SYS_MEMOP) != SYS_COPY
+			|| !(cmd & SYS_SNAP)))
+		systrap(tf, T_GPFLT, 0);	// needs a region to snapshot
 
-  // Find the named child process; DON'T create if it doesn't exist
-  uint32_t cn = tf->regs.edx & 0xff;
-  proc *cp = p->child[cn];
-  if (!cp)
-    cp = &proc_null;
+	uint32_t cn, n = syschildren(tf, cmd, &cn), i;
+	spinlock_acquire(&p->lock);
 
-  // Synchronize with child if necessary.
-  if (cp->state != PROC_STOP)
-    proc_wait(p, cp, tf);
+	// Find the named child processes; create any that don't exist
+	for (i = 0; i < n; i++)
+		if (!p->child[cn+i] && !proc_alloc(p, cn+i)) {
+			spinlock_release(&p->lock);
+			systrap(tf, T_NOMEM, 0);
+		}
 
-  // Since the child is now stopped, it's ours to control;
-  // we no longer need our process lock -
-  // and we don't want to be holding it if usercopy() below aborts.
-  spinlock_release(&p->lock);
+	// Synchronize with children if necessary.
+	// For a range, sleep until the first that's still running stops;
+	// the others keep running meanwhile, and we check them all again
+	// when the PUT restarts.
+	for (i = 0; i < n; i++)
+		if (p->child[cn+i]->state != PROC_STOP)
+			proc_wait(p, p->child[cn+i], tf);
 
-  // Get child's general register state
-  if (cmd & SYS_REGS) {
-    int len = offsetof(procstate, fx);  // just integer regs
-    if (cmd & SYS_FPU) len = sizeof(procstate); // whole shebang
-usercopy(tf, 1, &cp->sv, tf->regs.ebx, len);
-    // Copy child process's trapframe into user space
-    procstate *cs = (procstate*) tf->regs.ebx;
-    memcpy(cs, &cp->sv, len);
-  }
-uint32_t sva = tf->regs.esi;
+	// Since the children are now stopped, they're ours to control;
+	// we no longer need our process lock -
+	// and we don't want to be holding it if usercopy() below aborts.
+	spinlock_release(&p->lock);
+	proc *cp = p->child[cn];
+
+	// Put child's general register state
+	if (cmd & SYS_REGS) {
+		int len = offsetof(procstate, fx);  // just integer regs
+		if (cmd & SYS_FPU) len = sizeof(procstate); // whole shebang
+
+		p->opchild = cp;
+		usercopy(tf,0,&cp->sv, tf->regs.ebx, len);
+
+		// Make sure process uses user-mode segments and eflag settings
+		cp->sv.tf.ds = CPU_GDT_UDATA | 3;
+		cp->sv.tf.es = CPU_GDT_UDATA | 3;
+		cp->sv.tf.cs = CPU_GDT_UCODE | 3;
+		cp->sv.tf.ss = CPU_GDT_UDATA | 3;
+		cp->sv.tf.eflags &= FL_USER;
+		cp->sv.tf.eflags |= FL_IF;  // enable interrupts
+
+		// The rest of a range start from the same state,
+		// each with its own child number in EDX.
+		if (cmd & SYS_RANGE)
+			for (i = 0; i < n; i++) {
+				if (i > 0)
+					memcpy(&p->child[cn+i]->sv, &cp->sv, len);
+				p->child[cn+i]->sv.tf.regs.edx = cn+i;
+			}
+	}
+
+	for (i = 0; i < n; i++)
+		put_child(tf, cmd, p, p->child[cn+i]);
+
+	pmap_invalflush();
+	trap_return(tf);  // syscall completed
+}
+
+// Add up the merge statistics of the children of a range GET.
+static void
+get_addstats(mergestats *sum, const mergestats *ms)
+{
+	sum->scanned += ms->scanned;
+	sum->copied += ms->copied;
+	sum->diffed += ms->diffed;
+	uint32_t i;
+	for (i = 0; i < MIN(ms->nconflict, MSTATS_CONFLICTS)
+			&& sum->nconflict + i < MSTATS_CONFLICTS; i++)
+		sum->conflicts[sum->nconflict + i] = ms->conflicts[i];
+	sum->nconflict += ms->nconflict;
+}
+
+// Do a GET's memory operations on child 'cp', which is stopped,
+// adding its merge statistics to 'sum' if SYS_MSTATS is set.
+static void
+get_child(trapframe *tf, uint32_t cmd, proc *p, proc *cp, mergestats *sum)
+{
+	p->opchild = cp;	// keep proc_reclaim() off it
+	if (cp != &proc_null)
+		cp->newstop = 0;
+
+	uint32_t sva = tf->regs.esi;
 	uint32_t dva = tf->regs.edi;
 	uint32_t size = tf->regs.ecx;
 	switch (cmd & SYS_MEMOP) {
@@ -245,14 +305,14 @@ uint32_t sva = tf->regs.esi;
 	case SYS_COPY:
 	case SYS_MERGE:
 		// validate source region
-		if (PTOFF(sva) || PTOFF(size)
+		if (PGOFF(sva) || PGOFF(size)
 				|| sva < VM_USERLO || sva > VM_USERHI
 				|| size > VM_USERHI-sva)
 			systrap(tf, T_GPFLT, 0);
 		// fall thru...
 	case SYS_ZERO:
 		// validate destination region
-		if (PTOFF(dva) || PTOFF(size)
+		if (PGOFF(dva) || PGOFF(size)
 				|| dva < VM_USERLO || dva > VM_USERHI
 				|| size > VM_USERHI-dva)
 			systrap(tf, T_GPFLT, 0);
@@ -262,11 +322,29 @@ uint32_t sva = tf->regs.esi;
 			pmap_remove(p->pdir, dva, size);
 			break;
 		case SYS_COPY:	// copy from local src to dest in child
-			pmap_copy(cp->pdir, sva, p->pdir, dva, size);
+			if (!pmap_copy(cp->pdir, sva, p->pdir, dva, size))
+				systrap(tf, T_NOMEM, 0);
 			break;
 		case SYS_MERGE:	// merge from local src to dest in child
-			pmap_merge(cp->rpdir, cp->pdir, sva,
-					p->pdir, dva, size);
+			// If the snapshot was reclaimed, merging against it
+			// would clobber our memory: report that instead.
+			// A merge that runs out of memory stops part way.
+			if (cp->snaplost)
+				systrap(tf, T_NOMEM, 0);
+			// Outside a SYS_SNAPONLY snapshot, every page the child
+			// has would look new: refuse rather than clobber ours.
+			if (cp->snaphi && (sva < cp->snaplo
+					|| sva + size > cp->snaphi))
+				systrap(tf, T_GPFLT, 0);
+			mergestats ms;
+			if (!pmap_merge(cp->rpdir, cp->pdir, sva,
+					p->pdir, dva, size,
+					(cmd & SYS_MSTATS) ? &ms : NULL))
+				systrap(tf, T_NOMEM, 0);
+			if (cmd & SYS_MSTATS)
+				get_addstats(sum, &ms);
+			if (cp != &proc_null)
+				cp->snapmerged = 1;
 			break;
 		}
 		break;
@@ -281,11 +359,95 @@ uint32_t sva = tf->regs.esi;
 				|| size > VM_USERHI-dva)
 			systrap(tf, T_GPFLT, 0);
 		if (!pmap_setperm(p->pdir, dva, size, cmd & SYS_RW))
-			panic("pmap_get: no memory to set permissions");
+			systrap(tf, T_NOMEM, 0);
 	}
 
-	if (cmd & SYS_SNAP)
+	if (cmd & (SYS_SNAP | SYS_SNAPONLY))
 		systrap(tf, T_GPFLT, 0);	// only valid for PUT
+
+	// Once the parent has merged the child's results,
+	// the snapshot only pins old copies of the parent's pages:
+	// releasing it lets later writes reuse those pages in place.
+	if ((cmd & SYS_UNSNAP) && cp != &proc_null) {
+		pmap_remove(cp->rpdir, VM_USERLO, VM_USERHI-VM_USERLO);
+		cp->snapmerged = cp->snaplost = 0;
+		cp->snaplo = cp->snaphi = 0;
+	}
+}
+
+  static void
+do_get(trapframe *tf, uint32_t cmd)
+{
+  proc *p = proc_cur();
+  assert(p->state == PROC_RUN && p->runcpu == cpu_cur());
+  //cprintf("GET proc %x eip %x esp %x cmd %x\n", p, tf->eip, tf->esp, cmd);
+
+  uint32_t cn, n = syschildren(tf, cmd, &cn), i;
+  if ((cmd & SYS_ANY) && (!(cmd & SYS_RANGE) || !(p->sv.pff & PFF_NONDET)))
+    systrap(tf, T_GPFLT, 0);
+  spinlock_acquire(&p->lock);
+
+  // With SYS_ANY, pick the first child in the range that has stopped
+  // since we last did a GET or PUT on it, or else wait for one to stop.
+  // If none is running, there's nothing to wait for: return -1 in EDX.
+  if (cmd & SYS_ANY) {
+    bool running = 0;
+    for (i = 0; i < n; i++) {
+      proc *cp = p->child[cn+i];
+      if (cp && cp->state == PROC_STOP && cp->newstop)
+        break;
+      if (cp && cp->state != PROC_STOP)
+        running = 1;
+    }
+    if (i == n && running)
+      proc_wait(p, NULL, tf);
+    if (i == n) {
+      spinlock_release(&p->lock);
+      tf->regs.edx = -1;
+      pmap_invalflush();
+      trap_return(tf);
+    }
+    cn += i, n = 1;
+  }
+
+  // Synchronize with children if necessary, as in do_put().
+  // A child that doesn't exist is always stopped.
+  for (i = 0; i < n; i++) {
+    proc *cp = p->child[cn+i];
+    if (cp && cp->state != PROC_STOP)
+      proc_wait(p, cp, tf);
+  }
+
+  // Since the children are now stopped, they're ours to control;
+  // we no longer need our process lock -
+  // and we don't want to be holding it if usercopy() below aborts.
+  spinlock_release(&p->lock);
+
+  mergestats sum;
+  memset(&sum, 0, sizeof(sum));
+  for (i = 0; i < n; i++) {
+    // Find the named child process; DON'T create if it doesn't exist
+    proc *cp = p->child[cn+i];
+    if (!cp)
+      cp = &proc_null;
+
+    // Get child's general register state:
+    // for a range, into an array of procstates, one per child.
+    if (cmd & SYS_REGS) {
+      int len = offsetof(procstate, fx);  // just integer regs
+      if (cmd & SYS_FPU) len = sizeof(procstate); // whole shebang
+      p->opchild = cp;
+      usercopy(tf, 1, &cp->sv, tf->regs.ebx + i*sizeof(procstate), len);
+    }
+
+    get_child(tf, cmd, p, cp, &sum);
+  }
+  if (cmd & SYS_MSTATS)
+    usercopy(tf, 1, &sum, tf->regs.ebp, sizeof(sum));
+  if (cmd & SYS_ANY)
+    tf->regs.edx = cn;	// tell the caller which child it got
+
+  pmap_invalflush();
   trap_return(tf);  // syscall completed
 }
 
@@ -307,8 +469,8 @@ syscall(trapframe *tf)
 	uint32_t cmd = tf->regs.eax;
 	switch (cmd & SYS_TYPE) {
 	case SYS_CPUTS:	return do_cputs(tf, cmd);
-	case SYS_PUT:	return do_put(tf, cmd);
-	case SYS_GET:	return do_get(tf, cmd);
+	case SYS_PUT:	pmap_invalbegin(); return do_put(tf, cmd);
+	case SYS_GET:	pmap_invalbegin(); return do_get(tf, cmd);
 	case SYS_RET:	return do_ret(tf);
 	default:	return;		// handle as a regular trap
 	}
@@ -48,7 +48,7 @@ trap_init_idt(void)
 		Xirq0,Xirq1,Xirq2,Xirq3,Xirq4,Xirq5,
 		Xirq6,Xirq7,Xirq8,Xirq9,Xirq10,Xirq11,
 		Xirq12,Xirq13,Xirq14,Xirq15,
-		Xsyscall,Xltimer,Xlerror,Xperfctr;
+		Xsyscall,Xltimer,Xlerror,Xlipi,Xperfctr;
 	int i;
 
 	// check that the SIZEOF_STRUCT_TRAPFRAME symbol is defined correctly
@@ -103,6 +103,7 @@ trap_init_idt(void)
 	// Vectors we use for local APIC interrupts
 	SETGATE(idt[T_LTIMER], 0, CPU_GDT_KCODE, &Xltimer, 0);
 	SETGATE(idt[T_LERROR], 0, CPU_GDT_KCODE, &Xlerror, 0);
+	SETGATE(idt[T_LIPI], 0, CPU_GDT_KCODE, &Xlipi, 0);
 
 }
 
@@ -151,6 +152,8 @@ const char *trap_name(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_NOMEM)
+		return "Out of memory";
 	if (trapno >= T_IRQ0 && trapno < T_IRQ0 + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
@@ -231,6 +234,10 @@ trap(trapframe *tf)
 	case T_LERROR:
 		lapic_errintr();
 		trap_return(tf);
+	case T_LIPI:	// cpu_wake() got us out of HLT: just carry on
+		lapic_eoi();
+		c->wakeups++;
+		trap_return(tf);
 	case T_IRQ0 + IRQ_KBD:
 		//cprintf("CPU%d: KBD\n", c->id);
 		kbd_intr();
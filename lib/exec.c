@@ -59,6 +59,18 @@ execv(const char *path, char *const argv[])
 	exec_start(esp);
 }
 
+// Find the pages of a program segment that come wholly from the file:
+// these can be copied from the file's data copy-on-write,
+// as long as the segment is at the same offset within a page in both.
+static void
+exec_cowpages(proghdr *ph, intptr_t *lo, intptr_t *hi)
+{
+	*lo = ROUNDUP(ph->p_va, PAGESIZE);
+	*hi = ROUNDDOWN(ph->p_va + ph->p_filesz, PAGESIZE);
+	if (PGOFF(ph->p_va) != PGOFF(ph->p_offset) || *hi <= *lo)
+		*lo = *hi = ph->p_va;
+}
+
 int
 exec_readelf(const char *path)
 {
@@ -108,9 +120,8 @@ exec_readelf(const char *path)
 		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
 			(void*)pagelo + scratchofs, pagehi - pagelo);
 
-		// Initialize the file-loaded part of the ELF image.
-		// (We could use copy-on-write if SYS_COPY
-		// supports copying at arbitrary page boundaries.)
+		// Initialize the file-loaded part of the ELF image,
+		// except for whole pages we'll copy-on-write below.
 		intptr_t filelo = ph->p_offset;
 		intptr_t filehi = filelo + ph->p_filesz;
 		if (filelo < 0 || filelo > imgsize
@@ -118,8 +129,12 @@ exec_readelf(const char *path)
 			warn("exec_readelf: loaded section out of bounds");
 			goto err;
 		}
+		intptr_t cowlo, cowhi;
+		exec_cowpages(ph, &cowlo, &cowhi);
 		memcpy((void*)valo + scratchofs, imgdata + filelo,
-			filehi - filelo);
+			cowlo - valo);
+		memcpy((void*)cowhi + scratchofs, imgdata + filelo + cowhi-valo,
+			filehi - filelo - (cowhi-valo));
 
 		// Finally, remove write permissions on read-only segments.
 		if (!(ph->p_flags & ELF_PROG_FLAG_WRITE))
@@ -131,6 +146,22 @@ exec_readelf(const char *path)
 	sys_put(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
 		(void*)VM_USERLO, EXEMAX);
 
+	// Then share the pages loaded wholly from the file copy-on-write.
+	for (ph = imgdata + eh->e_phoff; ph < eph; ph++) {
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		intptr_t cowlo, cowhi;
+		exec_cowpages(ph, &cowlo, &cowhi);
+		if (cowlo == cowhi)
+			continue;
+		int perm = SYS_READ;
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+			perm |= SYS_WRITE;
+		sys_put(SYS_COPY | SYS_PERM | perm, 0, NULL,
+			imgdata + ph->p_offset + cowlo - ph->p_va,
+			(void*)cowlo, cowhi - cowlo);
+	}
+
 	// The new program should have the same entrypoint as we do!
 	if (eh->e_entry != (intptr_t)start) {
 		warn("exec_readelf: executable has a different start address");
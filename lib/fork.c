@@ -26,7 +26,9 @@ bool reconcile(pid_t pid, filestate *cfiles);
 bool reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino);
 bool reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino);
 
-pid_t fork(void)
+// Fork a child, giving it PFF_NONDET if 'nondet'.
+static pid_t
+dofork(bool nondet)
 {
 	int i;
 
@@ -84,9 +86,16 @@ pid_t fork(void)
 	}
 
 	// Copy our entire user address space into the child and start it.
+	// The child learns whether it's nondeterministic from the copy
+	// of files->nondet it gets.
 	ps.tf.regs.eax = 0;	// isparent == 0 in the child
+	if (nondet)
+		ps.pff = PFF_NONDET;
+	bool ournondet = files->nondet;
+	files->nondet = nondet;
 	sys_put(SYS_REGS | SYS_COPY | SYS_START, pid, &ps,
 		ALLVA, ALLVA, ALLSIZE);
+	files->nondet = ournondet;
 
 	// Record the inode generation numbers of all inodes at fork time,
 	// so that we can reconcile them later when we synchronize with it.
@@ -96,6 +105,22 @@ pid_t fork(void)
 	return pid;
 }
 
+// The child inherits our nondeterminism, if any.
+pid_t
+fork(void)
+{
+	return dofork(files->nondet);
+}
+
+// Fork a child that may use nondeterministic features,
+// so that wait() in it reaps children in the order they finish.
+// Processes are deterministic unless started this way.
+pid_t
+ndfork(void)
+{
+	return dofork(1);
+}
+
 pid_t
 wait(int *status)
 {
@@ -108,10 +133,11 @@ waitpid(pid_t pid, int *status, int options)
 	assert(pid >= -1 && pid < 256);
 
 	// Find a process to wait for.
-	// Of course for interactive or load-balancing purposes
-	// we would like to have a way to wait for
-	// whichever child process happens to finish first -
-	// that requires a (nondeterministic) kernel API extension.
+	// For interactive or load-balancing purposes we would like to wait
+	// for whichever child process happens to finish first:
+	// if we're allowed to be nondeterministic, the kernel can do that.
+	// Otherwise just pick the lowest-numbered child.
+	bool any = pid <= 0 && files->nondet;
 	if (pid <= 0)
 		for (pid = 1; pid < 256; pid++)
 			if (files->child[pid].state == PROC_FORKED)
@@ -121,13 +147,21 @@ waitpid(pid_t pid, int *status, int options)
 		return -1;
 	}
 
-	// Repeatedly synchronize with the chosen child until it exits.
+	// Repeatedly synchronize with the chosen child until it exits,
+	// or with any child that stops, until one of them exits.
+	// A forked child we aren't dealing with is always either running
+	// or stopped since we last got from it, so a wait-any GET finds it.
 	while (1) {
 		// Wait for the child to finish whatever it's doing,
 		// and extract its CPU and process/file state.
 		struct procstate ps;
-		sys_get(SYS_COPY | SYS_REGS, pid, &ps,
-			(void*)FILESVA, (void*)VM_SCRATCHLO, PTSIZE);
+		if (any) {
+			pid = sys_getany(SYS_COPY | SYS_REGS, 1, 255, &ps,
+				(void*)FILESVA, (void*)VM_SCRATCHLO, PTSIZE);
+			assert(pid > 0 && files->child[pid].state == PROC_FORKED);
+		} else
+			sys_get(SYS_COPY | SYS_REGS, pid, &ps,
+				(void*)FILESVA, (void*)VM_SCRATCHLO, PTSIZE);
 		filestate *cfiles = (filestate*)VM_SCRATCHLO;
 
 		// Did the child take a trap?
@@ -14,6 +14,7 @@ if gmake --version >/dev/null 2>&1; then make=gmake; else make=make; fi
 
 pts=5
 timeout=30
+qemumem=${qemumem:-1100M}
 preservefs=n
 #qemu=`$SHELL misc/which-qemu.sh`
 qemu=`sh misc/which-qemu.sh`
@@ -41,7 +42,7 @@ run () {
 	(
 		ulimit -t $timeout
 		exec $qemu -nographic $qemuopts -serial stdio -monitor null \
-			-no-reboot $qemuextra -m 1100M -smp 2
+			-no-reboot $qemuextra -m $qemumem -smp 2
 	) <$in >grade-out 2>$err &
 	PID=$!
 
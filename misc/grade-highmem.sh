@@ -0,0 +1,29 @@
+#!/bin/sh
+
+# Boot with 3GB of RAM, so that user pages come from highmem
+# above the kernel's 1GB direct map, and run the file system tests,
+# which fork, exec and merge heavily.
+qemuopts="-hda obj/kern/kernel.img"
+qemumem=3G
+. misc/grade-functions.sh
+
+
+$make
+run
+
+score=0
+
+pts=10; greptest "Memory map: " "Physical memory: 314[0-9]*K available"
+pts=10; greptest "Highmem:    " "highmem: [1-9][0-9]* pages above"
+pts=10; greptest "Allocator:  " "mem_check() succeeded!"
+pts=10; greptest "Page tables:" "pmap_check() succeeded!"
+pts=20; greptest "Initial FS: " "initfilecheck passed"
+pts=20; greptest "Read/write: " "readwritecheck passed"
+pts=20; grmltest "Exec:       " "called by execcheck.execcheck done"
+
+
+echo "Score: $score/100"
+
+if [ $score -lt 100 ]; then
+    exit 1
+fi
@@ -0,0 +1,28 @@
+#!/bin/sh
+
+# Boot testvm with only 32MB of RAM and a swap disk, so that
+# swapcheck's children only fit if their cold pages are swapped out.
+qemuopts="-hda obj/kern/kernel.img -hdb obj/kern/swap.img"
+qemumem=32M
+. misc/grade-functions.sh
+
+
+rm -f obj/kern/init.o
+$make DEFS=-DROOTEXE_START=_binary_obj_user_testvm_start
+rm -f obj/kern/init.o
+run
+
+score=0
+
+pts=10; greptest "Swap disk:  " "swap: [1-9][0-9]*KB on IDE disk 1"
+pts=10; greptest "Page tables:" "pmap_check() succeeded!"
+pts=20; greptest "Fork:       " "testvm: forkcheck passed"
+pts=20; greptest "Merge:      " "testvm: mergecheck passed"
+pts=40; greptest "Swapping:   " "testvm: swapcheck passed"
+
+
+echo "Score: $score/100"
+
+if [ $score -lt 100 ]; then
+    exit 1
+fi
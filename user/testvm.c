@@ -26,6 +26,8 @@ extern uint8_t start[], etext[], edata[], end[];
 uint8_t stack[2][STACKSIZE];
 
 
+uint32_t forkpff;	// Process feature flags fork() gives children
+
 // Fork a child process, returning 0 in the child and 1 in the parent.
 int
 fork(int cmd, uint8_t child)
@@ -33,6 +35,7 @@ fork(int cmd, uint8_t child)
 	// Set up the register state for the child
 	struct procstate ps;
 	memset(&ps, 0, sizeof(ps));
+	ps.pff = forkpff;
 
 	// Use some assembly magic to propagate registers to child
 	// and generate an appropriate starting eip
@@ -81,6 +84,61 @@ join(int cmd, uint8_t child, int trapexpect)
 	}
 }
 
+// Fork 'n' children starting at child number 'first' with one PUT,
+// returning its own child number in each child and -1 in the parent.
+int
+forkrange(int cmd, uint8_t first, int n)
+{
+	struct procstate ps;
+	memset(&ps, 0, sizeof(ps));
+
+	// As in fork(), but the kernel hands each child its number in EDX.
+	int isparent, child;
+	asm volatile(
+		"	movl	%%esi,%0;"
+		"	movl	%%edi,%1;"
+		"	movl	%%ebp,%2;"
+		"	movl	%%esp,%3;"
+		"	movl	$1f,%4;"
+		"	movl	$1,%5;"
+		"1:	"
+		: "=m" (ps.tf.regs.esi),
+		  "=m" (ps.tf.regs.edi),
+		  "=m" (ps.tf.regs.ebp),
+		  "=m" (ps.tf.esp),
+		  "=m" (ps.tf.eip),
+		  "=a" (isparent),
+		  "=d" (child)
+		:
+		: "ebx", "ecx");
+	if (!isparent)
+		return child;	// in a child
+
+	ps.tf.regs.eax = 0;	// isparent == 0 in the children
+	sys_putrange(cmd | SYS_REGS | SYS_COPY, first, n, &ps,
+			ALLVA, ALLVA, ALLSIZE);
+	return -1;
+}
+
+// Wait for 'n' children starting at 'first' with one GET, as in join().
+void
+joinrange(int cmd, uint8_t first, int n, int trapexpect)
+{
+	static struct procstate ps[64];
+	assert(n <= 64);
+	if ((cmd & SYS_MEMOP) == SYS_MERGE)
+		cmd |= SYS_UNSNAP;
+	sys_getrange(cmd | SYS_REGS, first, n, ps, ALLVA, ALLVA,
+			ALLSIZE-PTSIZE);
+
+	int i;
+	for (i = 0; i < n; i++)
+		if (ps[i].tf.trapno != trapexpect)
+			panic("joinrange: child %d: unexpected trap %d, "
+				"expecting %d\n", first + i,
+				ps[i].tf.trapno, trapexpect);
+}
+
 void
 gentrap(int trap)
 {
@@ -190,6 +248,29 @@ forkcheck()
 	join(0, 5, T_ILLOP);
 	join(0, 6, T_GPFLT);
 
+	// Processes are deterministic unless started with PFF_NONDET...
+	if (!fork(SYS_START, 0)) sys_getany(0, 1, 1, NULL, NULL, NULL, 0);
+	join(0, 0, T_GPFLT);
+
+	// ...which lets a child reap its own in whatever order they stop
+	forkpff = PFF_NONDET;
+	if (!fork(SYS_START, 2)) {
+		forkpff = 0;
+		struct procstate ps;
+		if (!fork(SYS_START, 0)) gentrap(T_SYSCALL);
+		if (!fork(SYS_START, 1)) gentrap(T_DIVIDE);
+		int got = sys_getany(SYS_REGS, 0, 2, &ps, NULL, NULL, 0);
+		assert(got == 0 || got == 1);
+		assert(ps.tf.trapno == (got == 0 ? T_SYSCALL : T_DIVIDE));
+		assert(sys_getany(SYS_REGS, 0, 2, &ps, NULL, NULL, 0)
+			== 1 - got);
+		assert(ps.tf.trapno == (got == 0 ? T_DIVIDE : T_SYSCALL));
+		assert(sys_getany(0, 0, 2, NULL, NULL, NULL, 0) == -1);
+		gentrap(T_SYSCALL);
+	}
+	forkpff = 0;
+	join(0, 2, T_SYSCALL);
+
 	// Check that kernel address space is inaccessible to user code
 	readfaulttest(0);
 	readfaulttest(VM_USERLO-4);
@@ -327,6 +408,60 @@ memopcheck(void)
 	sys_get(SYS_PERM|SYS_READ, 0, NULL, NULL, dva2+ofs, PAGESIZE);
 	assert(*(volatile int*)(dva2+ofs) == 0xdeadbeef);	// survived?
 
+	// Test page-granular SYS_COPY, straddling 4MB boundaries,
+	// with child 1 since the fault tests above use child 0
+	sva = (void*)VM_USERLO+PTSIZE*4 - 2*PAGESIZE;
+	dva = (void*)VM_USERLO+PTSIZE*6 - PAGESIZE;
+	dva2 = (void*)VM_USERLO+PTSIZE*8 + 3*PAGESIZE;
+	sys_get(SYS_PERM|SYS_READ|SYS_WRITE, 0, NULL, NULL, sva, 4*PAGESIZE);
+	int i;
+	for (i = 0; i < 4; i++)
+		*(volatile int*)(sva + i*PAGESIZE) = 0x1000 + i;
+	sys_put(SYS_COPY, 1, NULL, sva+PAGESIZE, dva, 2*PAGESIZE);
+	sys_get(SYS_COPY, 1, NULL, dva-PAGESIZE, dva2, 4*PAGESIZE);
+	readfaulttest(dva2);			// only the pages we asked for
+	assert(*(volatile int*)(dva2+PAGESIZE) == 0x1001);
+	assert(*(volatile int*)(dva2+2*PAGESIZE) == 0x1002);
+	readfaulttest(dva2+3*PAGESIZE);
+
+	// The copies are copy-on-write in both directions
+	*(volatile int*)(sva+PAGESIZE) = 0xdeadbeef;
+	assert(*(volatile int*)(dva2+PAGESIZE) == 0x1001);
+	*(volatile int*)(dva2+2*PAGESIZE) = 0xabadcafe;
+	assert(*(volatile int*)(sva+2*PAGESIZE) == 0x1002);
+	sys_get(SYS_COPY, 1, NULL, dva, dva2, PAGESIZE);
+	assert(*(volatile int*)(dva2) == 0x1001);
+
+	// Page-granular SYS_ZERO, and copies must still be page-aligned
+	sys_get(SYS_ZERO, 0, NULL, NULL, sva+PAGESIZE, 2*PAGESIZE);
+	readfaulttest(sva+PAGESIZE);
+	assert(*(volatile int*)(sva+3*PAGESIZE) == 0x1003);
+	if (!fork(SYS_START, 0)) {
+		sys_put(SYS_COPY, 1, NULL, sva+4, dva, PAGESIZE);
+		sys_ret();
+	}
+	join(0, 0, T_GPFLT);
+	sys_get(SYS_ZERO, 0, NULL, NULL, sva, 4*PAGESIZE);
+	sys_get(SYS_ZERO, 0, NULL, NULL, dva2, 4*PAGESIZE);
+	sys_put(SYS_ZERO, 1, NULL, NULL, dva, 2*PAGESIZE);
+
+	// Sequential write faults are resolved a window of pages at a time,
+	// but the window stops short of a page that isn't writable
+	sva = (void*)VM_USERLO+PTSIZE*4;
+	sys_get(SYS_PERM|SYS_RW, 0, NULL, NULL, sva, 24*PAGESIZE);
+	sys_get(SYS_PERM|SYS_READ, 0, NULL, NULL, sva+20*PAGESIZE, PAGESIZE);
+	if (!fork(SYS_START, 0)) {
+		for (i = 0; i < 24; i++)
+			*(volatile int*)(sva + i*PAGESIZE) = i;
+		sys_ret();
+	}
+	join(0, 0, T_PGFLT);
+	sys_get(SYS_COPY, 0, NULL, sva, sva, 24*PAGESIZE);
+	for (i = 0; i < 20; i++)
+		assert(*(volatile int*)(sva + i*PAGESIZE) == i);
+	assert(*(volatile int*)(sva + 20*PAGESIZE) == 0);
+	sys_get(SYS_ZERO, 0, NULL, NULL, sva, 24*PAGESIZE);
+
 	cprintf("testvm: memopcheck passed\n");
 }
 
@@ -434,25 +569,20 @@ matmult(int a[8][8], int b[8][8], int r[8][8])
 {
 	int i,j,k;
 
-	// Fork off a thread to compute each cell in the result matrix
-	for (i = 0; i < 8; i++)
-		for (j = 0; j < 8; j++) {
-			int child = i*8 + j;
-			if (!fork(SYS_START | SYS_SNAP, child)) {
-				int sum = 0;	// in child: compute cell i,j
-				for (k = 0; k < 8; k++)
-					sum += a[i][k] * b[k][j];
-				r[i][j] = sum;
-				sys_ret();
-			}
-		}
+	// Fork off a thread to compute each cell in the result matrix,
+	// all with one PUT: each child learns which cell from its number.
+	int child = forkrange(SYS_START | SYS_SNAP, 0, 64);
+	if (child >= 0) {
+		i = child / 8, j = child % 8;
+		int sum = 0;	// in child: compute cell i,j
+		for (k = 0; k < 8; k++)
+			sum += a[i][k] * b[k][j];
+		r[i][j] = sum;
+		sys_ret();
+	}
 
-	// Now go back and merge in the results of all our children
-	for (i = 0; i < 8; i++)
-		for (j = 0; j < 8; j++) {
-			int child = i*8 + j;
-			join(SYS_MERGE, child, T_SYSCALL);
-		}
+	// Now merge in the results of all our children with one GET
+	joinrange(SYS_MERGE, 0, 64, T_SYSCALL);
 }
 
 void
@@ -485,9 +615,135 @@ mergecheck()
 	assert(sizeof(mc) == sizeof(int)*8*8);
 	assert(memcmp(mr, mc, sizeof(mr)) == 0);
 
+	// Merge just one page of a child's changes, not 4MB-aligned,
+	// into a page that we have changed too
+	volatile int *pg = (volatile int*)(VM_USERLO+PTSIZE*3);
+	int i;
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, (void*)pg, 3*PAGESIZE);
+	if (!fork(SYS_START | SYS_SNAP, 0)) {
+		for (i = 0; i < 3; i++)
+			pg[i*PAGESIZE/4] = i+1;
+		sys_ret();
+	}
+	pg[PAGESIZE/4 + 1] = 7;
+	pg[2*PAGESIZE/4] = 9;		// conflicts with the child's write
+	mergestats ms;
+	sys_getstats(SYS_MERGE, 0, NULL,
+		(void*)pg+PAGESIZE, (void*)pg+PAGESIZE, PAGESIZE, &ms);
+	assert(pg[0] == 0 && pg[2*PAGESIZE/4] == 9);
+	assert(pg[PAGESIZE/4] == 2 && pg[PAGESIZE/4 + 1] == 7);
+	assert(ms.scanned == 1 && ms.diffed == PAGESIZE);
+	assert(ms.copied == 0 && ms.nconflict == 0);
+
+	// Merging the conflicting page drops it, and says where it was
+	sys_getstats(SYS_MERGE | SYS_UNSNAP, 0, NULL,
+		(void*)pg+2*PAGESIZE, (void*)pg+2*PAGESIZE, PAGESIZE, &ms);
+	assert(ms.scanned == 1 && ms.nconflict == 1);
+	assert(ms.conflicts[0] == (uint32_t)pg+2*PAGESIZE);
+	readfaulttest(pg+2*PAGESIZE/4);
+	sys_get(SYS_ZERO, 0, NULL, NULL, (void*)pg, 3*PAGESIZE);
+
+	// Snapshot just the page we copy in, and merge the child's write
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, (void*)pg, PAGESIZE);
+	if (!fork(0, 0)) { pg[0] = 5; sys_ret(); }
+	sys_put(SYS_COPY | SYS_SNAP | SYS_SNAPONLY | SYS_START, 0, NULL,
+		(void*)pg, (void*)pg, PAGESIZE);
+	sys_getstats(SYS_MERGE | SYS_UNSNAP, 0, NULL,
+		(void*)pg, (void*)pg, PAGESIZE, &ms);
+	assert(pg[0] == 5);
+	assert(ms.scanned == 1 && ms.copied == 1 && ms.nconflict == 0);
+	sys_get(SYS_ZERO, 0, NULL, NULL, (void*)pg, PAGESIZE);
+
+	// Without SYS_SNAPONLY the snapshot still covers everything,
+	// so a merge wider than the copy leaves our other pages alone
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, (void*)pg, 2*PAGESIZE);
+	pg[PAGESIZE/4] = 8;
+	if (!fork(0, 0)) { pg[0] = 5; sys_ret(); }
+	sys_put(SYS_COPY | SYS_SNAP | SYS_START, 0, NULL,
+		(void*)pg, (void*)pg, PAGESIZE);
+	sys_getstats(SYS_MERGE | SYS_UNSNAP, 0, NULL,
+		(void*)pg, (void*)pg, 2*PAGESIZE, &ms);
+	assert(pg[0] == 5 && pg[PAGESIZE/4] == 8);
+	assert(ms.nconflict == 0);
+
+	// ...while a merge wider than a SYS_SNAPONLY snapshot is refused
+	if (!fork(SYS_START, 1)) {
+		if (!fork(0, 0)) sys_ret();
+		sys_put(SYS_COPY | SYS_SNAP | SYS_SNAPONLY | SYS_START, 0,
+			NULL, (void*)pg, (void*)pg, PAGESIZE);
+		sys_get(SYS_MERGE, 0, NULL, (void*)pg, (void*)pg, 2*PAGESIZE);
+		sys_ret();
+	}
+	join(0, 1, T_GPFLT);
+	assert(pg[0] == 5 && pg[PAGESIZE/4] == 8);
+	sys_get(SYS_ZERO, 0, NULL, NULL, (void*)pg, 2*PAGESIZE);
+
+	// A plain merge keeps the child's snapshot to merge against again,
+	// so pages neither of us wrote are skipped; after SYS_UNSNAP drops it,
+	// every page the child has looks new and must be compared
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, (void*)pg, 2*PAGESIZE);
+	pg[PAGESIZE/4] = 8;
+	for (i = 0; i < 2; i++) {
+		if (!fork(SYS_START | SYS_SNAP, 0)) { pg[0] = 5; sys_ret(); }
+		sys_getstats(SYS_MERGE | (i ? SYS_UNSNAP : 0), 0, NULL,
+			(void*)pg, (void*)pg, PAGESIZE, &ms);
+		assert(pg[0] == 5 && ms.copied == 1);
+		sys_getstats(SYS_MERGE, 0, NULL, (void*)pg+PAGESIZE,
+			(void*)pg+PAGESIZE, PAGESIZE, &ms);
+		assert(pg[PAGESIZE/4] == 8 && ms.nconflict == 0);
+		assert(ms.diffed == (i ? PAGESIZE : 0));
+		pg[0] = 0;
+	}
+	sys_get(SYS_ZERO, 0, NULL, NULL, (void*)pg, 2*PAGESIZE);
+
 	cprintf("testvm: mergecheck passed\n");
 }
 
+#define SWAPSIZE	(24*1024*1024)	// Too much for two children in 32MB
+
+// Fill a child's big region with a pattern particular to that child,
+// or check that the pattern is still there.
+static void
+swapfill(uint8_t *va, int child, bool check)
+{
+	uint32_t *w = (uint32_t*)va;
+	int i;
+	for (i = 0; i < SWAPSIZE/4; i += PAGESIZE/4)
+		if (check)
+			assert(w[i] == (i ^ (child << 24)));
+		else
+			w[i] = i ^ (child << 24);
+}
+
+void
+swapcheck()
+{
+	// Two children each touch more memory than they can both have,
+	// and the first checks that its pages came back from swap intact.
+	uint8_t *va = (uint8_t*)VM_SHAREHI;
+	int child;
+	for (child = 0; child < 2; child++)
+		if (!fork(SYS_START, child)) {
+			sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, va, SWAPSIZE);
+			swapfill(va, child, 0);
+			sys_ret();
+			swapfill(va, child, 1);
+			sys_ret();
+		}
+	for (child = 0; child < 2; child++)
+		join(0, child, T_SYSCALL);
+
+	// Let the first child check its pages, with the second one's around.
+	sys_put(SYS_START, 0, NULL, NULL, NULL, 0);
+	join(0, 0, T_SYSCALL);
+
+	// Free all that memory again.
+	for (child = 0; child < 2; child++)
+		sys_put(SYS_ZERO, child, NULL, va, va, SWAPSIZE);
+
+	cprintf("testvm: swapcheck passed\n");
+}
+
 int
 main()
 {
@@ -498,6 +754,7 @@ main()
 	protcheck();
 	memopcheck();
 	mergecheck();
+	swapcheck();
 
 	cprintf("testvm: all tests completed successfully!\n");
 	return 0;